@@ -5,40 +5,169 @@
 #include <sstream>
 #include <chrono>
 #include <algorithm>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <memory>
+#include <map>
+#include <deque>
+#include <set>
+#include <new>
+#include <type_traits>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
 
 using namespace std;
 
+// Append-only dictionary mapping repeated strings (authors, publishers,
+// member IDs) to dense 32-bit codes. Interning takes a mutex; reading a
+// code someone already handed out takes no lock, since the chunk table
+// never moves and stored strings never change.
+class StringDictionary {
+private:
+    static const size_t CHUNK_BITS = 12;
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+    static const size_t MAX_CHUNKS = size_t(1) << 14;
+
+    vector<unique_ptr<string[]>> chunks;
+    unordered_map<string, uint32_t> codes;
+    uint32_t count;
+    mutable mutex lock;
+
+public:
+    static const uint32_t NONE = 0xffffffffu;
+
+    StringDictionary() : chunks(MAX_CHUNKS), count(0) {}
+
+    uint32_t intern(const string& value) {
+        lock_guard<mutex> guard(lock);
+        auto it = codes.find(value);
+        if (it != codes.end()) return it->second;
+
+        if (count == CHUNK_SIZE * MAX_CHUNKS) throw length_error("string dictionary is full");
+        size_t chunk = count >> CHUNK_BITS;
+        if (!chunks[chunk]) chunks[chunk].reset(new string[CHUNK_SIZE]);
+        chunks[chunk][count & (CHUNK_SIZE - 1)] = value;
+        codes.emplace(value, count);
+        return count++;
+    }
+
+    // Code of an already interned string, NONE if it was never interned.
+    // Takes the lock, so hot paths keep the code rather than look it up.
+    uint32_t find(const string& value) const {
+        lock_guard<mutex> guard(lock);
+        auto it = codes.find(value);
+        return it == codes.end() ? NONE : it->second;
+    }
+
+    const string& lookup(uint32_t code) const { return chunks[code >> CHUNK_BITS][code & (CHUNK_SIZE - 1)]; }
+
+    // Codes handed out so far; every code is below this
+    uint32_t size() const {
+        lock_guard<mutex> guard(lock);
+        return count;
+    }
+};
+
+// Circulation state of a book, one byte per record
+enum class Availability : uint8_t { Available, Borrowed, Reserved };
+
+const char* availabilityName(Availability state) {
+    switch (state) {
+        case Availability::Borrowed: return "borrowed";
+        case Availability::Reserved: return "reserved";
+        default: return "available";
+    }
+}
+
+Availability parseAvailability(const string& status) {
+    if (status == "borrowed") return Availability::Borrowed;
+    if (status == "reserved") return Availability::Reserved;
+    return Availability::Available;
+}
+
+// Book and member records are comma-separated lines in the CSVs and the
+// journal, so a stored value may hold no comma or line break
+bool fitsCsvField(const string& value) { return value.find_first_of(",\r\n") == string::npos; }
+
 class Book {
 private:
-    string isbn, name, creator, company;
-    string availability, bookedBy;
-    int publicationYear;
+    // Author, publisher and reserving member are codes into the shared
+    // dictionaries; only the ISBN and title are stored per book
+    string isbn, name;
+    uint32_t creator, company, bookedBy;
+    int32_t publicationYear;
+    Availability availability;
+    bool dirty = false;  // changed since book.csv was last written
 
 public:
+    static StringDictionary creators, publishers, memberIds;
+
     // Constructor with different parameter order
     Book(string isbn_val, string name_val, int year_val, string creator_val, string company_val) 
-        : isbn(isbn_val), name(name_val), publicationYear(year_val), 
-          creator(creator_val), company(company_val), availability("available"), bookedBy("") {}
+        : isbn(isbn_val), name(name_val), creator(creators.intern(creator_val)),
+          company(publishers.intern(company_val)), bookedBy(StringDictionary::NONE),
+          publicationYear(year_val), availability(Availability::Available) {}
+
+    // From author and publisher codes the caller has already interned
+    Book(string isbn_val, string name_val, int year_val, uint32_t creator_code, uint32_t company_code)
+        : isbn(move(isbn_val)), name(move(name_val)), creator(creator_code), company(company_code),
+          bookedBy(StringDictionary::NONE), publicationYear(year_val), availability(Availability::Available) {}
 
     // Getters with different names
-    string getISBN() const { return isbn; }
-    string getName() const { return name; }
-    string getCreator() const { return creator; }
-    string getCompany() const { return company; }
+    const string& getISBN() const { return isbn; }
+    const string& getName() const { return name; }
+    const string& getCreator() const { return creators.lookup(creator); }
+    const string& getCompany() const { return publishers.lookup(company); }
     int getPublicationYear() const { return publicationYear; }
-    string getAvailability() const { return availability; }
-    string getBookedBy() const { return bookedBy; }
+    string getAvailability() const { return availabilityName(availability); }
+    string getBookedBy() const { return bookedBy == StringDictionary::NONE ? "" : memberIds.lookup(bookedBy); }
+
+    // Compact accessors for the hot paths
+    Availability getState() const { return availability; }
+    uint32_t getReserverCode() const { return bookedBy; }
+    uint32_t getCompanyCode() const { return company; }
+    bool hasReservation() const { return bookedBy != StringDictionary::NONE; }
     
     // Setters with different names
-    void setAvailability(string status) { availability = status; }
-    void setBookedBy(string memberId) { bookedBy = memberId; }
+    void setAvailability(string status) { availability = parseAvailability(status); }
+    void setBookedBy(string memberId) { bookedBy = memberId.empty() ? StringDictionary::NONE : memberIds.intern(memberId); }
+    void setState(Availability state) { availability = state; }
+    void setReserverCode(uint32_t memberCode) { bookedBy = memberCode; }
+    void clearReservation() { bookedBy = StringDictionary::NONE; }
+
+    // Dirty tracking for incremental export
+    void markDirty() { dirty = true; }
+    bool isDirty() const { return dirty; }
+    void clearDirty() { dirty = false; }
 
     // Data serialization function
     string serialize() const {
         ostringstream data;
-        data << isbn << "," << name << "," << creator << "," 
-             << company << "," << publicationYear << "," 
-             << availability << "," << bookedBy;
+        data << isbn << "," << name << "," << getCreator() << "," 
+             << getCompany() << "," << publicationYear << "," 
+             << getAvailability() << "," << getBookedBy();
         return data.str();
     }
 
@@ -63,24 +192,31 @@ public:
     }
 };
 
+StringDictionary Book::creators, Book::publishers, Book::memberIds;
+
 struct BorrowInfo {
     string isbn;
     chrono::system_clock::time_point checkoutDate;
+    int accruedDays = 0;  // late days already charged by the nightly accrual
 };
 
 class Membership {
 private:
     string memberId;
     vector<BorrowInfo> checkedOutItems;
+    vector<string> reservedItems;  // ISBNs this member is queued for
     double pendingFees;
+    atomic<int> blockingLoans{0};  // loans held past the borrowing block
+    bool dirty = false;            // loans or fees changed since the last export
 
 public:
     // Constructor
     Membership(string id) : memberId(id), pendingFees(0.0) {}
 
     // Methods with different naming
-    void checkoutItem(const string& isbn) {
-        checkedOutItems.push_back({isbn, chrono::system_clock::now()});
+    void checkoutItem(const string& isbn, chrono::system_clock::time_point when) {
+        checkedOutItems.push_back({isbn, when});
+        dirty = true;
     }
 
     void returnItem(const string& isbn, double fee) {
@@ -89,414 +225,6299 @@ public:
         if (it != checkedOutItems.end()) {
             checkedOutItems.erase(it);
             pendingFees += fee;
+            dirty = true;
         }
     }
 
     // Getters and setters
     double getPendingFees() const { return pendingFees; }
-    void clearFees(double amount) { pendingFees = max(0.0, pendingFees - amount); }
-    void setPendingFees(double fee) { pendingFees = fee; }
+    void clearFees(double amount) { pendingFees = max(0.0, pendingFees - amount); dirty = true; }
+    void setPendingFees(double fee) { pendingFees = fee; dirty = true; }
     const vector<BorrowInfo>& getCheckedOutItems() const { return checkedOutItems; }
 
-    void addCheckoutRecord(const BorrowInfo& info) { checkedOutItems.push_back(info); }
+    void addCheckoutRecord(const BorrowInfo& info) { checkedOutItems.push_back(info); dirty = true; }
+
+    BorrowInfo* findLoan(const string& isbn) {
+        auto it = find_if(checkedOutItems.begin(), checkedOutItems.end(), 
+                         [&isbn](const BorrowInfo& info) { return info.isbn == isbn; });
+        return it == checkedOutItems.end() ? nullptr : &*it;
+    }
+
+    // Charge late days up to daysLate that have not been charged yet
+    void accrueLateDays(BorrowInfo& loan, int daysLate, double fee) {
+        loan.accruedDays = daysLate;
+        pendingFees += fee;
+        dirty = true;
+    }
+
+    // Maintained by the library's due-date timers
+    int getBlockingLoans() const { return blockingLoans; }
+    void addBlockingLoan(int delta) { blockingLoans += delta; }
+
+    // Dirty tracking for incremental export
+    bool isDirty() const { return dirty; }
+    void clearDirty() { dirty = false; }
+
+    // Reservations, kept in step with the books' waitlists
+    void addReservation(const string& isbn) { reservedItems.push_back(isbn); }
+    void removeReservation(const string& isbn) {
+        auto it = find(reservedItems.begin(), reservedItems.end(), isbn);
+        if (it != reservedItems.end()) reservedItems.erase(it);
+    }
+    bool hasReservation(const string& isbn) const {
+        return find(reservedItems.begin(), reservedItems.end(), isbn) != reservedItems.end();
+    }
+    int getReservationCount() const { return reservedItems.size(); }
+    const vector<string>& getReservedItems() const { return reservedItems; }
+};
+
+// Borrowing rules per member type. Members carry a kind that indexes this
+// table, so eligibility and fee checks are plain loads instead of virtual
+// calls or type-name compares.
+enum class MemberKind : uint8_t { Student, Faculty, Librarian };
+
+struct BorrowingPolicy {
+    const char* typeName;    // as stored in members.csv
+    int maxItems;            // 0: may not borrow
+    int loanPeriod;          // days
+    int feePerDay;           // rupees per late day
+    int blockAfterDays;      // an unreturned loan older than this blocks borrowing, 0 if never
+    bool blockedByFees;      // pending fees block borrowing
+};
+
+const BorrowingPolicy MEMBER_POLICIES[] = {
+    {"student", 3, 15, 10, 0, true},
+    {"faculty", 5, 30, 0, 90, false},   // 30 days + 60 days late
+    {"librarian", 0, 0, 0, 0, false},
 };
 
-// Member base class and derived classes (renamed from User)
+// False if the type name is unknown
+bool parseMemberKind(const string& type, MemberKind& kind) {
+    for (uint8_t i = 0; i < sizeof(MEMBER_POLICIES) / sizeof(MEMBER_POLICIES[0]); i++) {
+        if (type == MEMBER_POLICIES[i].typeName) {
+            kind = static_cast<MemberKind>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
 class Member {
-protected:
-    string memberId, fullName, memberType;
+private:
+    string memberId, fullName;
+    uint32_t memberCode;   // memberId in Book::memberIds
+    MemberKind kind;
     Membership membership;
 
-public:
-    Member(string id, string name, string type) 
-        : memberId(id), fullName(name), memberType(type), membership(id) {}
-    virtual ~Member() {}
-    
-    // Getters
-    string getMemberId() const { return memberId; }
-    string getFullName() const { return fullName; }
-    string getMemberType() const { return memberType; }
-    Membership& getMembership() { return membership; }
-    const Membership& getMembership() const { return membership; }
-    
-    // Pure virtual methods
-    virtual bool isEligibleToBorrow() const = 0;
-    virtual int calculateLateFee(int daysLate) const = 0;
+public:
+    Member(string id, string name, MemberKind kind_val) 
+        : memberId(id), fullName(name), memberCode(Book::memberIds.intern(id)), kind(kind_val), membership(id) {}
+    
+    // Getters
+    string getMemberId() const { return memberId; }
+    // Interned once here, so circulation compares reservers by code
+    // without the dictionary lock
+    uint32_t getMemberCode() const { return memberCode; }
+    string getFullName() const { return fullName; }
+    string getMemberType() const { return policy().typeName; }
+    MemberKind getKind() const { return kind; }
+    const BorrowingPolicy& policy() const { return MEMBER_POLICIES[static_cast<uint8_t>(kind)]; }
+    Membership& getMembership() { return membership; }
+    const Membership& getMembership() const { return membership; }
+    
+    // Policy checks
+    bool canBorrow() const { return policy().maxItems > 0; }
+
+    bool isEligibleToBorrow() const {
+        const BorrowingPolicy& rules = policy();
+        return static_cast<int>(membership.getCheckedOutItems().size()) < rules.maxItems &&
+               (!rules.blockedByFees || membership.getPendingFees() == 0) &&
+               membership.getBlockingLoans() == 0;
+    }
+    
+    int calculateLateFee(int daysLate) const { return daysLate > 0 ? daysLate * policy().feePerDay : 0; }
+    int getLoanPeriod() const { return policy().loanPeriod; }
+    int getBlockAfterDays() const { return policy().blockAfterDays; }
+
+    // Serialization method
+    string serialize() const { return memberId + "," + fullName + "," + getMemberType(); }
+};
+
+// Stable handles into the catalog and member slots. A handle stays valid
+// across vector reallocation; only removing the record invalidates it.
+typedef size_t BookHandle;
+typedef size_t MemberHandle;
+const size_t NO_HANDLE = static_cast<size_t>(-1);
+
+// Arena of members in fixed-size chunks: a roster loads with one allocation
+// per chunk, a Member* stays valid as the pool grows, and removed slots are
+// reused. Members are destroyed in slot order by clear() or the destructor.
+class MemberPool {
+private:
+    static const size_t CHUNK_SIZE = 1024;
+    typedef aligned_storage<sizeof(Member), alignof(Member)>::type Slot;
+
+    vector<unique_ptr<Slot[]>> chunks;
+    vector<bool> live;
+    vector<MemberHandle> freeSlots;
+
+    Member* slot(MemberHandle handle) const {
+        return reinterpret_cast<Member*>(&chunks[handle / CHUNK_SIZE][handle % CHUNK_SIZE]);
+    }
+
+public:
+    MemberPool() {}
+    MemberPool(const MemberPool&) = delete;
+    MemberPool& operator=(const MemberPool&) = delete;
+    ~MemberPool() { clear(); }
+
+    MemberHandle create(const string& id, const string& name, MemberKind kind) {
+        MemberHandle handle;
+        if (!freeSlots.empty()) {
+            handle = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            handle = live.size();
+            if (handle % CHUNK_SIZE == 0) chunks.emplace_back(new Slot[CHUNK_SIZE]);
+            live.push_back(false);
+        }
+        new (slot(handle)) Member(id, name, kind);
+        live[handle] = true;
+        return handle;
+    }
+
+    void destroy(MemberHandle handle) {
+        slot(handle)->~Member();
+        live[handle] = false;
+        freeSlots.push_back(handle);
+    }
+
+    void clear() {
+        for (MemberHandle i = 0; i < live.size(); i++) {
+            if (live[i]) slot(i)->~Member();
+        }
+        chunks.clear();
+        live.clear();
+        freeSlots.clear();
+    }
+
+    void reserve(size_t count) { chunks.reserve((count + CHUNK_SIZE - 1) / CHUNK_SIZE); live.reserve(count); }
+
+    // Slot count, including removed slots
+    size_t size() const { return live.size(); }
+
+    // nullptr for a removed slot
+    Member* operator[](MemberHandle handle) const { return live[handle] ? slot(handle) : nullptr; }
+};
+
+// Append-only redo log of library mutations, one record per line. The first
+// line "J,<epoch>" names the snapshot epoch the records apply on top of.
+// Only the JournalWriter thread appends: each batch of queued records is one
+// write and one fdatasync, and the changes in it are durable once that sync
+// returns.
+class Journal {
+private:
+    string path;
+    int fd;
+    size_t unsynced, recordCount;
+    unsigned long long epoch;
+
+    void writeHeader() {
+        string header = "J," + to_string(epoch) + "\n";
+        if (write(fd, header.data(), header.size()) != static_cast<ssize_t>(header.size())) {
+            cerr << "Warning: journal write failed.\n";
+        }
+    }
+
+public:
+    Journal() : fd(-1), unsynced(0), recordCount(0), epoch(0) {}
+    ~Journal() { close(); }
+
+    // Read the complete records of an existing journal. A torn final record
+    // from a crash mid-write is dropped from the file.
+    vector<string> load(const string& file) {
+        path = file;
+        vector<string> records;
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) return records;
+
+        string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        size_t start = 0, end;
+        while ((end = contents.find('\n', start)) != string::npos) {
+            records.push_back(contents.substr(start, end - start));
+            start = end + 1;
+        }
+        in.close();
+        if (start != contents.size() && truncate(path.c_str(), start) != 0) {
+            cerr << "Warning: could not trim torn journal record.\n";
+        }
+        if (!records.empty() && records.front().compare(0, 2, "J,") == 0) {
+            epoch = stoull(records.front().substr(2));
+            records.erase(records.begin());
+        }
+        recordCount = records.size();
+        return records;
+    }
+
+    bool open() {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return false;
+        if (lseek(fd, 0, SEEK_END) == 0) writeHeader();
+        return true;
+    }
+
+    // Append newline-terminated records, finishing a short write. If the
+    // write fails the partial batch is cut off again, so no torn record is
+    // left in the middle of the file.
+    void appendBatch(const string& lines, size_t count) {
+        if (fd < 0) return;
+        off_t before = lseek(fd, 0, SEEK_END);
+        for (size_t written = 0; written < lines.size();) {
+            ssize_t n = write(fd, lines.data() + written, lines.size() - written);
+            if (n > 0) {
+                written += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                cerr << "Warning: journal write failed, " << count << " change(s) not journaled.\n";
+                if (before < 0 || ftruncate(fd, before) != 0) cerr << "Warning: could not trim the partial journal write.\n";
+                return;
+            }
+        }
+        recordCount += count;
+        unsynced += count;
+    }
+
+    void sync() {
+        if (fd >= 0 && unsynced > 0) fdatasync(fd);
+        unsynced = 0;
+    }
+
+    // Drop all records once the snapshot of the given epoch covers them
+    void reset(unsigned long long newEpoch) {
+        epoch = newEpoch;
+        unsynced = 0;
+        recordCount = 0;
+        if (fd < 0) {
+            // Not open yet: empty the file so open() writes the new header
+            if (!path.empty() && truncate(path.c_str(), 0) != 0 && errno != ENOENT) {
+                cerr << "Warning: could not reset journal.\n";
+            }
+            return;
+        }
+        if (ftruncate(fd, 0) == 0) writeHeader();
+        fdatasync(fd);
+    }
+
+    void close() {
+        if (fd < 0) return;
+        sync();
+        ::close(fd);
+        fd = -1;
+    }
+
+    size_t size() const { return recordCount; }
+    unsigned long long getEpoch() const { return epoch; }
+};
+
+// Compact the journal into a fresh snapshot once it holds this many records
+const size_t JOURNAL_COMPACT_THRESHOLD = 10000;
+
+// Group commit: a batch is written once this many records are queued or the
+// oldest has waited this long; producers block while the queue is full
+const size_t GROUP_COMMIT_RECORDS = 256;
+const chrono::milliseconds GROUP_COMMIT_INTERVAL(2);
+const size_t JOURNAL_QUEUE_CAPACITY = 1 << 16;
+
+// Background journal writer. Mutations enqueue their records and return; the
+// writer thread appends them in batches with one write and one fdatasync per
+// batch. Every record gets a sequence number, and a caller that needs
+// durability waits until the durable sequence reaches it.
+class JournalWriter {
+private:
+    Journal& journal;
+    mutex fileLock;      // held while writing or resetting the journal file, before queueLock
+    mutex queueLock;
+    condition_variable wake, space, committed;
+    vector<string> pending;
+    uint64_t queued = 0, durable = 0;
+    size_t waiters = 0;
+    bool stopping = false;
+    thread worker;
+
+    void writeBatch() {
+        lock_guard<mutex> file(fileLock);
+        vector<string> batch;
+        uint64_t last;
+        {
+            lock_guard<mutex> lock(queueLock);
+            batch.swap(pending);
+            last = queued;
+        }
+        space.notify_all();
+        if (batch.empty()) return;
+
+        string lines;
+        for (const string& record : batch) {
+            lines += record;
+            lines += '\n';
+        }
+        journal.appendBatch(lines, batch.size());
+        journal.sync();
+        {
+            lock_guard<mutex> lock(queueLock);
+            durable = max(durable, last);
+        }
+        committed.notify_all();
+    }
+
+    void run() {
+        unique_lock<mutex> lock(queueLock);
+        while (true) {
+            // Sleep until there is work, then give the batch time to fill
+            wake.wait(lock, [this] { return stopping || !pending.empty(); });
+            wake.wait_for(lock, GROUP_COMMIT_INTERVAL, [this] {
+                return stopping || pending.size() >= GROUP_COMMIT_RECORDS || waiters > 0;
+            });
+            bool finished = stopping;
+            lock.unlock();
+            writeBatch();
+            lock.lock();
+            if (finished && pending.empty()) break;
+        }
+    }
+
+public:
+    explicit JournalWriter(Journal& target) : journal(target) {}
+    ~JournalWriter() { stop(); }
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+
+    void start() { worker = thread(&JournalWriter::run, this); }
+
+    // Drain the queue to disk and end the writer thread
+    void stop() {
+        if (!worker.joinable()) return;
+        {
+            lock_guard<mutex> lock(queueLock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // Returns the record's sequence number; blocks while the queue is full
+    uint64_t enqueue(const string& record) {
+        unique_lock<mutex> lock(queueLock);
+        space.wait(lock, [this] { return pending.size() < JOURNAL_QUEUE_CAPACITY || stopping; });
+        pending.push_back(record);
+        uint64_t sequence = ++queued;
+        if (pending.size() == 1 || pending.size() == GROUP_COMMIT_RECORDS) wake.notify_one();
+        return sequence;
+    }
+
+    // Block until the record with this sequence number is on disk
+    void waitFor(uint64_t sequence) {
+        unique_lock<mutex> lock(queueLock);
+        if (durable >= sequence || !worker.joinable()) return;
+        waiters++;
+        wake.notify_one();
+        committed.wait(lock, [this, sequence] { return durable >= sequence; });
+        waiters--;
+    }
+
+    // Block until everything queued so far is on disk
+    void flush() {
+        uint64_t sequence;
+        {
+            lock_guard<mutex> lock(queueLock);
+            sequence = queued;
+        }
+        waitFor(sequence);
+    }
+
+    // Empty the journal once a snapshot covers it. Queued records describe
+    // changes the snapshot already holds, so they are dropped and count as
+    // durable. The caller must keep new records from being enqueued.
+    void reset(unsigned long long epoch) {
+        lock_guard<mutex> file(fileLock);
+        {
+            lock_guard<mutex> lock(queueLock);
+            pending.clear();
+            journal.reset(epoch);
+            durable = queued;
+        }
+        space.notify_all();
+        committed.notify_all();
+    }
+};
+
+// A field of a memory-mapped CSV line; points into the mapping, no copy
+struct FieldView {
+    const char* data;
+    size_t size;
+
+    string str() const { return string(data, size); }
+    bool empty() const { return size == 0; }
+};
+
+bool parseInt64(const FieldView& field, long long& out) {
+    const char* p = field.data;
+    const char* end = field.data + field.size;
+    bool negative = (p != end && *p == '-');
+    if (negative) p++;
+    if (p == end) return false;
+
+    long long value = 0;
+    for (; p != end; p++) {
+        if (*p < '0' || *p > '9') return false;
+        value = value * 10 + (*p - '0');
+    }
+    out = negative ? -value : value;
+    return true;
+}
+
+bool parseDouble(const FieldView& field, double& out) {
+    char buffer[64];
+    if (field.size == 0 || field.size >= sizeof(buffer)) return false;
+    memcpy(buffer, field.data, field.size);
+    buffer[field.size] = '\0';
+    char* parsedEnd;
+    out = strtod(buffer, &parsedEnd);
+    return parsedEnd == buffer + field.size;
+}
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+    const char* base;
+    size_t length;
+
+public:
+    MappedFile() : base(nullptr), length(0) {}
+    ~MappedFile() { if (base) munmap(const_cast<char*>(base), length); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // False if the file does not exist; an empty file maps to no data
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                base = static_cast<const char*>(mapped);
+                length = info.st_size;
+                madvise(mapped, length, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+        return true;
+    }
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+};
+
+// Splits a mapped CSV into lines and fields without copying. The last field
+// of a record takes the rest of the line, matching getline on the tail.
+class CsvScanner {
+private:
+    const char* pos;
+    const char* end;
+    size_t lines = 0;
+
+public:
+    CsvScanner(const char* data, size_t size) : pos(data), end(data + size) {}
+    explicit CsvScanner(const MappedFile& file) : CsvScanner(file.data(), file.size()) {}
+
+    // Line number of the record nextRecord last returned, counted from the
+    // start of the scanned text
+    size_t line() const { return lines; }
+
+    // Next non-empty line split into exactly `count` fields; false at end of
+    // input. Lines with too few fields are skipped.
+    bool nextRecord(FieldView* fields, size_t count) {
+        while (pos < end) {
+            const char* lineEnd = static_cast<const char*>(memchr(pos, '\n', end - pos));
+            if (!lineEnd) lineEnd = end;
+            const char* p = pos;
+            const char* stop = (lineEnd > p && lineEnd[-1] == '\r') ? lineEnd - 1 : lineEnd;
+            pos = lineEnd + (lineEnd < end ? 1 : 0);
+            lines++;
+            if (p == stop) continue;
+
+            size_t found = 0;
+            for (; found + 1 < count; found++) {
+                const char* comma = static_cast<const char*>(memchr(p, ',', stop - p));
+                if (!comma) break;
+                fields[found] = {p, static_cast<size_t>(comma - p)};
+                p = comma + 1;
+            }
+            if (found + 1 != count) continue;
+            fields[found] = {p, static_cast<size_t>(stop - p)};
+            return true;
+        }
+        return false;
+    }
+};
+
+// Build a Book from the seven fields of a catalog record. The BookedBy field
+// holds the reservation queue "first;second;..."; only the first member is
+// set on the book, the caller restores the rest of the waitlist.
+bool bookFromFields(const FieldView* f, Book& out) {
+    long long year;
+    if (f[0].empty() || !parseInt64(f[4], year)) return false;
+    out = Book(f[0].str(), f[1].str(), static_cast<int>(year), f[2].str(), f[3].str());
+    out.setAvailability(f[5].str());
+    const char* separator = static_cast<const char*>(memchr(f[6].data, ';', f[6].size));
+    out.setBookedBy(separator ? string(f[6].data, separator) : f[6].str());
+    return true;
+}
+
+// Run independent tasks on up to threadCount threads, the caller's included
+void runConcurrently(const vector<function<void()>>& tasks, unsigned threadCount) {
+    atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i = next++; i < tasks.size(); i = next++) tasks[i]();
+    };
+    vector<thread> helpers;
+    for (size_t t = 1; t < min<size_t>(max(1u, threadCount), tasks.size()); t++) helpers.emplace_back(work);
+    work();
+    for (thread& helper : helpers) helper.join();
+}
+
+// Split text into about `parts` slices that end at line boundaries
+vector<pair<const char*, const char*>> splitAtLines(const char* data, size_t size, size_t parts) {
+    vector<pair<const char*, const char*>> slices;
+    const char* begin = data;
+    const char* end = data + size;
+    for (size_t i = 1; i <= parts && begin < end; i++) {
+        const char* stop = max(begin, data + size * i / parts);
+        if (stop < end) {
+            const char* newline = static_cast<const char*>(memchr(stop, '\n', end - stop));
+            stop = newline ? newline + 1 : end;
+        }
+        slices.push_back(make_pair(begin, stop));
+        begin = stop;
+    }
+    return slices;
+}
+
+// A member, loan or fee row that names a member or book that does not
+// exist. `file` is the name the row was loaded from.
+struct DanglingReference {
+    const char* file;
+    size_t line;
+    const char* field;   // "member" or "isbn"
+    string value;
+};
+
+// Rows of the data files, parsed by the startup loader's workers before
+// they are applied. Fields point into the mapped files.
+struct CatalogSlice {
+    const char* begin;
+    const char* end;
+    vector<Book> books;
+    vector<FieldView> waitlists;   // BookedBy field of each book
+};
+
+struct MemberRow {
+    FieldView id, name;
+    MemberKind kind;
+};
+
+struct LoanRow {
+    size_t line;
+    FieldView member, isbn;
+    long long checkoutDate, accruedDays;
+};
+
+struct FeeRow {
+    size_t line;
+    FieldView member;
+    double fee;
+};
+
+// Parsers for the startup loader. Rows that do not parse, such as a header
+// line, are skipped.
+void parseCatalogSlice(CatalogSlice& slice) {
+    CsvScanner scanner(slice.begin, slice.end - slice.begin);
+    FieldView f[7];
+    Book item("", "", 0, "", "");
+    while (scanner.nextRecord(f, 7)) {
+        if (!bookFromFields(f, item)) continue;
+        slice.books.push_back(move(item));
+        slice.waitlists.push_back(f[6]);
+    }
+}
+
+vector<MemberRow> parseMemberRows(const MappedFile& file) {
+    vector<MemberRow> rows;
+    CsvScanner scanner(file);
+    FieldView f[3];
+    MemberKind kind;
+    while (scanner.nextRecord(f, 3)) {
+        if (parseMemberKind(f[2].str(), kind)) rows.push_back(MemberRow{f[0], f[1], kind});
+    }
+    return rows;
+}
+
+// member,isbn,checkout[,accrued late days]
+vector<LoanRow> parseLoanRows(const MappedFile& file) {
+    vector<LoanRow> rows;
+    CsvScanner scanner(file);
+    FieldView f[3];
+    long long timeStamp, accruedDays;
+    while (scanner.nextRecord(f, 3)) {
+        FieldView accrued{nullptr, 0};
+        const char* comma = static_cast<const char*>(memchr(f[2].data, ',', f[2].size));
+        if (comma) {
+            accrued = {comma + 1, static_cast<size_t>(f[2].data + f[2].size - comma - 1)};
+            f[2].size = comma - f[2].data;
+        }
+        if (!parseInt64(f[2], timeStamp)) continue;
+        if (!comma || !parseInt64(accrued, accruedDays)) accruedDays = 0;
+        rows.push_back(LoanRow{scanner.line(), f[0], f[1], timeStamp, accruedDays});
+    }
+    return rows;
+}
+
+vector<FeeRow> parseFeeRows(const MappedFile& file) {
+    vector<FeeRow> rows;
+    CsvScanner scanner(file);
+    FieldView f[2];
+    double fee;
+    while (scanner.nextRecord(f, 2)) {
+        if (parseDouble(f[1], fee)) rows.push_back(FeeRow{scanner.line(), f[0], fee});
+    }
+    return rows;
+}
+
+// A vendor feed row that did not make it into the catalog
+struct RejectedRow {
+    size_t line;
+    const char* reason;
+    string text;
+};
+
+// Outcome of LibrarySystem::ingestCatalog
+struct IngestReport {
+    size_t rows = 0, added = 0;
+    vector<RejectedRow> rejected;
+    double parseSeconds = 0, mergeSeconds = 0;
+};
+
+// A parsed feed row and where it came from
+struct FeedRow {
+    size_t line;
+    FieldView text;
+    Book book;
+};
+
+// One newline-aligned slice of a vendor feed, parsed by a worker. Line
+// numbers are relative to the slice until the slices are stitched together.
+struct FeedChunk {
+    const char* begin;
+    const char* end;
+    bool first;
+    size_t lines = 0;
+    vector<FeedRow> books;
+    vector<RejectedRow> rejected;
+};
+
+// Parse feed rows "isbn,title,author,publisher,year[,...]"; columns after
+// the year are ignored, so an exported book.csv can be fed back in. The
+// worker's own caches of author and publisher codes keep it off the
+// shared dictionaries' locks for values it has seen before.
+void parseFeedChunk(FeedChunk& chunk, unordered_map<string, uint32_t>& creatorCodes,
+                    unordered_map<string, uint32_t>& publisherCodes) {
+    auto intern = [](unordered_map<string, uint32_t>& cache, StringDictionary& dictionary, const FieldView& field) {
+        string value = field.str();
+        auto it = cache.find(value);
+        if (it != cache.end()) return it->second;
+        uint32_t code = dictionary.intern(value);
+        cache.emplace(move(value), code);
+        return code;
+    };
+
+    const char* pos = chunk.begin;
+    while (pos < chunk.end) {
+        const char* lineEnd = static_cast<const char*>(memchr(pos, '\n', chunk.end - pos));
+        if (!lineEnd) lineEnd = chunk.end;
+        const char* stop = (lineEnd > pos && lineEnd[-1] == '\r') ? lineEnd - 1 : lineEnd;
+        const char* p = pos;
+        pos = lineEnd + (lineEnd < chunk.end ? 1 : 0);
+        size_t line = ++chunk.lines;
+        if (p == stop) continue;
+
+        FieldView f[5];
+        size_t found = 0;
+        for (; found < 5; found++) {
+            const char* comma = static_cast<const char*>(memchr(p, ',', stop - p));
+            f[found] = {p, static_cast<size_t>((comma ? comma : stop) - p)};
+            if (!comma) {
+                found++;
+                break;
+            }
+            p = comma + 1;
+        }
+
+        long long year;
+        const char* reason = nullptr;
+        if (found < 5) reason = "missing_fields";
+        else if (f[0].empty()) reason = "empty_isbn";
+        else if (!parseInt64(f[4], year)) reason = "bad_year";
+        if (reason) {
+            // A header row ("isbn,..." or the catalog's own "ISBN,...") is expected, not rejected
+            if (chunk.first && line == 1 && f[0].size == 4 && strncasecmp(f[0].data, "isbn", 4) == 0) continue;
+            chunk.rejected.push_back(RejectedRow{line, reason, string(f[0].data, stop)});
+            continue;
+        }
+        FieldView text = {f[0].data, static_cast<size_t>(stop - f[0].data)};
+        chunk.books.push_back(FeedRow{line, text, Book(f[0].str(), f[1].str(), static_cast<int>(year),
+                                                       intern(creatorCodes, Book::creators, f[2]),
+                                                       intern(publisherCodes, Book::publishers, f[3]))});
+    }
+}
+
+// Binary snapshot layout (native byte order):
+//   header   "LIBSNAP1" magic, u32 version, u32 section count, u64 epoch
+//   section  u32 tag, u64 payload bytes, payload
+// Every string is stored once in the STRG pool and referenced by index.
+const char SNAPSHOT_MAGIC[8] = {'L', 'I', 'B', 'S', 'N', 'A', 'P', '1'};
+const uint32_t SNAPSHOT_VERSION = 2;
+enum SnapshotTag : uint32_t {
+    SECTION_STRINGS = 0x47525453,  // "STRG": u32 count, u32 lengths[count], bytes
+    SECTION_BOOKS = 0x4b4f4f42,    // "BOOK": u32 count, SnapshotBook[count]
+    SECTION_MEMBERS = 0x424d454d,  // "MEMB": u32 count, SnapshotMember[count]
+    SECTION_LOANS = 0x4e414f4c,    // "LOAN": u32 count, SnapshotLoan[count]
+    SECTION_FEES = 0x53454546      // "FEES": u32 count, SnapshotFee[count]
+};
+
+struct SnapshotBook { uint32_t isbn, name, creator, company, availability, bookedBy; int32_t year; };
+struct SnapshotMember { uint32_t id, name, type; };
+struct SnapshotLoan { uint32_t member, isbn; int64_t checkoutDate, accruedDays; };
+struct SnapshotLoanV1 { uint32_t member, isbn; int64_t checkoutDate; };  // version 1, before fee accrual
+struct SnapshotFee { uint32_t member; double fee; };
+
+// Deduplicating string table for the STRG section
+class StringPool {
+private:
+    unordered_map<string, uint32_t> ids;
+    vector<const string*> strings;
+
+public:
+    uint32_t intern(const string& value) {
+        auto inserted = ids.emplace(value, static_cast<uint32_t>(strings.size()));
+        if (inserted.second) strings.push_back(&inserted.first->first);
+        return inserted.first->second;
+    }
+
+    string serialize() const {
+        string out;
+        uint32_t count = strings.size();
+        out.append(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (const string* value : strings) {
+            uint32_t length = value->size();
+            out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        }
+        for (const string* value : strings) out += *value;
+        return out;
+    }
+};
+
+// Append a POD array section: u32 count followed by the records
+template <typename T>
+void appendSection(string& out, uint32_t tag, const vector<T>& records) {
+    uint32_t count = records.size();
+    uint64_t bytes = sizeof(count) + records.size() * sizeof(T);
+    out.append(reinterpret_cast<const char*>(&tag), sizeof(tag));
+    out.append(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+    out.append(reinterpret_cast<const char*>(&count), sizeof(count));
+    if (!records.empty()) out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T));
+}
+
+// Bounds-checked view of one POD section of a mapped snapshot
+template <typename T>
+bool readSection(const char* payload, uint64_t bytes, vector<T>& records) {
+    uint32_t count;
+    if (bytes < sizeof(count)) return false;
+    memcpy(&count, payload, sizeof(count));
+    if (bytes != sizeof(count) + static_cast<uint64_t>(count) * sizeof(T)) return false;
+    records.resize(count);
+    if (count) memcpy(records.data(), payload + sizeof(count), count * sizeof(T));
+    return true;
+}
+
+// fsync the directory holding path, so a rename into it survives a crash
+bool syncParentDirectory(const string& path) {
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Write a file through a temporary and rename it into place, so readers
+// only ever see the old or the new contents
+bool writeFileAtomically(const string& path, const string& contents) {
+    string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    bool ok = write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size());
+    ok = ok && fdatasync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+    return syncParentDirectory(path);
+}
+
+// Buffered writer over a file descriptor; output goes out in large writes
+// instead of one stream flush per line
+class BufferedWriter {
+private:
+    int fd;
+    string buffer;
+    size_t capacity;
+    uint64_t total = 0;   // bytes accepted so far
+    bool ok = true;       // false once a write has failed
+
+public:
+    explicit BufferedWriter(int fileDescriptor, size_t bufferSize = 1 << 16)
+        : fd(fileDescriptor), capacity(bufferSize) { buffer.reserve(capacity); }
+    ~BufferedWriter() { flush(); }
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    BufferedWriter& operator<<(const string& text) { return append(text.data(), text.size()); }
+    BufferedWriter& operator<<(const char* text) { return *this << string(text); }
+    BufferedWriter& operator<<(char c) { return append(&c, 1); }
+    BufferedWriter& operator<<(long long value) { return *this << to_string(value); }
+    BufferedWriter& operator<<(int value) { return *this << to_string(value); }
+    BufferedWriter& operator<<(size_t value) { return *this << to_string(value); }
+    BufferedWriter& operator<<(double value) {
+        ostringstream text;
+        text << value;
+        return *this << text.str();
+    }
+
+    BufferedWriter& append(const char* data, size_t size) {
+        total += size;
+        if (size >= capacity) {
+            flush();
+            writeAll(data, size);
+            return *this;
+        }
+        buffer.append(data, size);
+        if (buffer.size() >= capacity) flush();
+        return *this;
+    }
+
+    void flush() {
+        writeAll(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    uint64_t bytesWritten() const { return total; }
+    bool good() const { return ok; }
+
+private:
+    void writeAll(const char* data, size_t size) {
+        size_t written = 0;
+        while (written < size) {
+            ssize_t n = write(fd, data + written, size - written);
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            written += n;
+        }
+    }
+};
+
+// Records per segment of an incrementally rewritten CSV
+const size_t CSV_SEGMENT_RECORDS = 4096;
+
+// Rewrite a CSV whose records are grouped into segments, through a temporary
+// file that is renamed over the old one. A clean segment whose bytes in the
+// old file are known is copied verbatim; the others are serialized again by
+// writeSegment(segment, writer). segmentEnds holds each segment's end offset
+// in the file and is updated on success.
+template <typename WriteSegment>
+bool rewriteSegments(const string& path, size_t segmentCount, const vector<bool>& dirtySegments,
+                     vector<uint64_t>& segmentEnds, WriteSegment writeSegment) {
+    MappedFile old;
+    bool reuse = !segmentEnds.empty() && old.open(path) && old.size() == segmentEnds.back();
+
+    string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    vector<uint64_t> ends;
+    ends.reserve(segmentCount);
+    bool ok;
+    {
+        BufferedWriter out(fd, 1 << 20);
+        for (size_t i = 0; i < segmentCount; i++) {
+            if (reuse && i < segmentEnds.size() && !dirtySegments[i]) {
+                uint64_t begin = i ? segmentEnds[i - 1] : 0;
+                out.append(old.data() + begin, segmentEnds[i] - begin);
+            } else {
+                writeSegment(i, out);
+            }
+            ends.push_back(out.bytesWritten());
+        }
+        out.flush();
+        ok = out.good();
+    }
+    ok = ok && fdatasync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+    segmentEnds.swap(ends);
+    return syncParentDirectory(path);
+}
+
+// Append a string as a JSON string literal; runs of characters that need
+// no escaping are copied in one go
+void appendJsonQuoted(string& out, const string& text) {
+    out += '"';
+    size_t plain = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c != '"' && c != '\\' && static_cast<unsigned char>(c) >= 0x20) continue;
+        out.append(text, plain, i - plain);
+        plain = i + 1;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default: {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+        }
+    }
+    out.append(text, plain, string::npos);
+    out += '"';
+}
+
+// Quote and escape a string as a JSON string literal
+string jsonQuote(const string& text) {
+    string out;
+    appendJsonQuoted(out, text);
+    return out;
+}
+
+// Parse one flat JSON object whose values are strings, numbers, booleans or
+// null. Non-string values are kept as their source text.
+bool parseJsonObject(const char* p, const char* end, unordered_map<string, string>& fields) {
+    auto skipSpace = [&]() { while (p < end && isspace(static_cast<unsigned char>(*p))) p++; };
+    auto parseString = [&](string& out) {
+        if (p >= end || *p != '"') return false;
+        for (p++; p < end && *p != '"'; p++) {
+            if (*p != '\\') { out += *p; continue; }
+            if (++p >= end) return false;
+            switch (*p) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    if (end - p < 5) return false;
+                    unsigned code = stoul(string(p + 1, 4), nullptr, 16);
+                    p += 4;
+                    if (code < 0x80) {
+                        out += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        out += static_cast<char>(0xc0 | (code >> 6));
+                        out += static_cast<char>(0x80 | (code & 0x3f));
+                    } else {
+                        out += static_cast<char>(0xe0 | (code >> 12));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                        out += static_cast<char>(0x80 | (code & 0x3f));
+                    }
+                    break;
+                }
+                default: out += *p;
+            }
+        }
+        if (p >= end) return false;
+        p++;
+        return true;
+    };
+
+    skipSpace();
+    if (p >= end || *p != '{') return false;
+    p++;
+    skipSpace();
+    if (p < end && *p == '}') return true;
+
+    while (p < end) {
+        string key, value;
+        skipSpace();
+        if (!parseString(key)) return false;
+        skipSpace();
+        if (p >= end || *p != ':') return false;
+        p++;
+        skipSpace();
+        if (p < end && *p == '"') {
+            if (!parseString(value)) return false;
+        } else {
+            const char* start = p;
+            while (p < end && *p != ',' && *p != '}' && !isspace(static_cast<unsigned char>(*p))) p++;
+            value.assign(start, p);
+            if (value.empty() || value[0] == '{' || value[0] == '[') return false;
+        }
+        fields[key] = value;
+        skipSpace();
+        if (p < end && *p == ',') { p++; continue; }
+        if (p < end && *p == '}') return true;
+        return false;
+    }
+    return false;
+}
+
+// Modification time of a file, 0 if it does not exist
+time_t fileModifiedTime(const string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? info.st_mtime : 0;
+}
+
+// The name exportData writes if that file exists in `dir`, otherwise the
+// header-bearing name the repository ships if that one does
+const char* dataFileName(const string& dir, const char* exported, const char* shipped) {
+    if (fileModifiedTime(dir + "/" + exported) == 0 && fileModifiedTime(dir + "/" + shipped) != 0) return shipped;
+    return exported;
+}
+
+// Split text into case-folded alphanumeric words for the search index
+vector<string> tokenize(const string& text) {
+    vector<string> tokens;
+    string current;
+    for (char c : text) {
+        if (isalnum(static_cast<unsigned char>(c))) {
+            current += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        } else if (!current.empty()) {
+            tokens.push_back(current);
+            current.clear();
+        }
+    }
+    if (!current.empty()) tokens.push_back(current);
+    return tokens;
+}
+
+// Case-folded completion key: letters lowered, runs of other characters
+// collapsed to one space, so "Data  Structures" and "data-structures" match
+string completionKey(const string& text) {
+    string key;
+    for (char c : text) {
+        if (isalnum(static_cast<unsigned char>(c))) {
+            key += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        } else if (!key.empty() && key.back() != ' ') {
+            key += ' ';
+        }
+    }
+    if (!key.empty() && key.back() == ' ') key.pop_back();
+    return key;
+}
+
+// Edit distance by the textbook dynamic program, one row at a time. Kept
+// as the reference the bit-parallel kernel is checked and benchmarked
+// against, and used for words too long for it.
+int levenshteinScalar(const string& a, const string& b) {
+    vector<int> row(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); j++) row[j] = static_cast<int>(j);
+    for (size_t i = 1; i <= a.size(); i++) {
+        int diagonal = row[0];
+        row[0] = static_cast<int>(i);
+        for (size_t j = 1; j <= b.size(); j++) {
+            int above = row[j];
+            row[j] = min(min(above, row[j - 1]) + 1, diagonal + (a[i - 1] != b[j - 1]));
+            diagonal = above;
+        }
+    }
+    return row[b.size()];
+}
+
+// Myers' bit-parallel edit distance. The pattern's column of the DP matrix
+// is kept as vertical +1/-1 deltas in two 64-bit words, so each character
+// of the text costs a dozen word operations however long the pattern is.
+// Patterns are limited to 64 characters.
+class EditDistanceKernel {
+private:
+    uint64_t peq[256];   // per character, the pattern positions holding it
+    size_t length;
+
+public:
+    static const size_t MAX_PATTERN = 64;
+
+    explicit EditDistanceKernel(const string& pattern)
+        : length(pattern.size() < MAX_PATTERN ? pattern.size() : MAX_PATTERN) {
+        memset(peq, 0, sizeof(peq));
+        for (size_t i = 0; i < length; i++) peq[static_cast<unsigned char>(pattern[i])] |= uint64_t(1) << i;
+    }
+
+    int distance(const string& text) const {
+        if (length == 0) return static_cast<int>(text.size());
+        uint64_t last = uint64_t(1) << (length - 1);
+        uint64_t pv = ~uint64_t(0), mv = 0;
+        int score = static_cast<int>(length);
+        for (char c : text) {
+            uint64_t eq = peq[static_cast<unsigned char>(c)];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            if (ph & last) score++;
+            else if (mh & last) score--;
+            // Row 0 grows by one per text character
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+        }
+        return score;
+    }
+};
+
+// Edits a query word may contain and still match: none for one or two
+// letters, one up to five, two beyond
+int allowedEdits(size_t length) {
+    return length <= 2 ? 0 : (length <= 5 ? 1 : 2);
+}
+
+// Trigram index over the distinct search tokens, for typo-tolerant lookup.
+// Tokens are padded to "$$token$$" and split into trigrams. One edit
+// touches at most three of them, so a word within k edits of a token
+// shares all but 3k of its distinct trigrams with it. Only tokens that
+// reach that count, and whose length is within k, are run through the
+// edit-distance kernel.
+class FuzzyTokenIndex {
+private:
+    vector<string> tokens;   // by id; empty once freed
+    vector<uint32_t> freeIds;
+    unordered_map<string, uint32_t> ids;
+    unordered_map<uint32_t, vector<uint32_t>> grams;
+
+    static vector<uint32_t> trigrams(const string& word) {
+        string padded = "$$" + word + "$$";
+        vector<uint32_t> result;
+        for (size_t i = 0; i + 3 <= padded.size(); i++) {
+            result.push_back(uint32_t(static_cast<unsigned char>(padded[i])) << 16 |
+                             uint32_t(static_cast<unsigned char>(padded[i + 1])) << 8 |
+                             uint32_t(static_cast<unsigned char>(padded[i + 2])));
+        }
+        sort(result.begin(), result.end());
+        result.erase(unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+public:
+    size_t size() const { return ids.size(); }
+
+    void add(const string& token) {
+        if (ids.count(token)) return;
+        uint32_t id;
+        if (!freeIds.empty()) {
+            id = freeIds.back();
+            freeIds.pop_back();
+            tokens[id] = token;
+        } else {
+            id = static_cast<uint32_t>(tokens.size());
+            tokens.push_back(token);
+        }
+        ids.emplace(token, id);
+        for (uint32_t gram : trigrams(token)) grams[gram].push_back(id);
+    }
+
+    void remove(const string& token) {
+        auto it = ids.find(token);
+        if (it == ids.end()) return;
+        uint32_t id = it->second;
+        ids.erase(it);
+        for (uint32_t gram : trigrams(token)) {
+            auto entry = grams.find(gram);
+            if (entry == grams.end()) continue;
+            vector<uint32_t>& postings = entry->second;
+            auto pos = find(postings.begin(), postings.end(), id);
+            if (pos != postings.end()) {
+                *pos = postings.back();
+                postings.pop_back();
+            }
+            if (postings.empty()) grams.erase(entry);
+        }
+        tokens[id].clear();
+        freeIds.push_back(id);
+    }
+
+    // Tokens within maxEdits of the word, with their distance
+    vector<pair<const string*, int>> within(const string& word, int maxEdits) const {
+        vector<pair<const string*, int>> result;
+        auto consider = [&](const string& token, const EditDistanceKernel& kernel) {
+            if (token.empty() || token.size() + maxEdits < word.size() || token.size() > word.size() + maxEdits) return;
+            int distance = word.size() <= EditDistanceKernel::MAX_PATTERN ? kernel.distance(token)
+                                                                            : levenshteinScalar(word, token);
+            if (distance <= maxEdits) result.push_back(make_pair(&token, distance));
+        };
+
+        EditDistanceKernel kernel(word);
+        vector<uint32_t> wordGrams = trigrams(word);
+        int threshold = static_cast<int>(wordGrams.size()) - 3 * maxEdits;
+        if (threshold <= 0) {
+            for (const string& token : tokens) consider(token, kernel);
+            return result;
+        }
+
+        vector<uint32_t> hits;
+        for (uint32_t gram : wordGrams) {
+            auto entry = grams.find(gram);
+            if (entry != grams.end()) hits.insert(hits.end(), entry->second.begin(), entry->second.end());
+        }
+        sort(hits.begin(), hits.end());
+        for (size_t i = 0; i < hits.size();) {
+            size_t j = i;
+            while (j < hits.size() && hits[j] == hits[i]) j++;
+            if (static_cast<int>(j - i) >= threshold) consider(tokens[hits[i]], kernel);
+            i = j;
+        }
+        return result;
+    }
+};
+
+// Radix trie from completion keys to books, for prefix completion. Edge
+// labels are slices of one shared character arena, so splitting an edge
+// only adjusts offsets. Children are linked first-child/next-sibling in
+// label order, so a walk visits keys in sorted order, and each key node
+// heads a list of the books with that key. Removing a key unlinks the
+// nodes it leaves empty; their arena bytes are not reclaimed.
+class CompletionTrie {
+private:
+    static const uint32_t NONE = 0xffffffffu;
+
+    struct Node {
+        uint32_t labelStart, labelLength;
+        uint32_t firstChild, nextSibling;
+        uint32_t firstPosting;
+    };
+
+    struct Posting {
+        uint32_t book, next;
+    };
+
+    string labels;
+    vector<Node> nodes;
+    vector<Posting> postings;
+    vector<uint32_t> freeNodes, freePostings;
+
+    uint32_t newNode(uint32_t start, uint32_t length) {
+        Node node = {start, length, NONE, NONE, NONE};
+        if (!freeNodes.empty()) {
+            uint32_t slot = freeNodes.back();
+            freeNodes.pop_back();
+            nodes[slot] = node;
+            return slot;
+        }
+        nodes.push_back(node);
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    char firstChar(uint32_t node) const { return labels[nodes[node].labelStart]; }
+
+    // Point the parent's child list at `node` in place of what followed `prev`
+    void link(uint32_t parent, uint32_t prev, uint32_t node) {
+        if (prev == NONE) nodes[parent].firstChild = node;
+        else nodes[prev].nextSibling = node;
+    }
+
+    // Child of `parent` whose label starts with `c`, or NONE; `prev` is
+    // left at the sibling before where it is or would be
+    uint32_t findChild(uint32_t parent, char c, uint32_t& prev) const {
+        prev = NONE;
+        uint32_t child = nodes[parent].firstChild;
+        while (child != NONE && static_cast<unsigned char>(firstChar(child)) < static_cast<unsigned char>(c)) {
+            prev = child;
+            child = nodes[child].nextSibling;
+        }
+        return child != NONE && firstChar(child) == c ? child : NONE;
+    }
+
+    // Length of the common prefix of a node's label and key[pos..]
+    size_t matchLabel(uint32_t node, const string& key, size_t pos) const {
+        const Node& n = nodes[node];
+        size_t common = 0;
+        while (common < n.labelLength && pos + common < key.size() &&
+               labels[n.labelStart + common] == key[pos + common]) common++;
+        return common;
+    }
+
+public:
+    CompletionTrie() { clear(); }
+
+    void clear() {
+        labels.clear();
+        nodes.clear();
+        postings.clear();
+        freeNodes.clear();
+        freePostings.clear();
+        nodes.push_back(Node{0, 0, NONE, NONE, NONE});
+    }
+
+    size_t nodeCount() const { return nodes.size() - freeNodes.size(); }
+
+    // The caller inserts each (key, book) pair once
+    void insert(const string& key, uint32_t book) {
+        if (key.empty()) return;
+        uint32_t node = 0;
+        size_t pos = 0;
+        while (pos < key.size()) {
+            uint32_t prev;
+            uint32_t child = findChild(node, key[pos], prev);
+            if (child == NONE) {
+                uint32_t leaf = newNode(static_cast<uint32_t>(labels.size()), static_cast<uint32_t>(key.size() - pos));
+                labels.append(key, pos, string::npos);
+                nodes[leaf].nextSibling = prev == NONE ? nodes[node].firstChild : nodes[prev].nextSibling;
+                link(node, prev, leaf);
+                node = leaf;
+                break;
+            }
+
+            size_t common = matchLabel(child, key, pos);
+            if (common < nodes[child].labelLength) {
+                // Split the edge: the shared part becomes a new parent
+                uint32_t upper = newNode(nodes[child].labelStart, static_cast<uint32_t>(common));
+                nodes[upper].nextSibling = nodes[child].nextSibling;
+                nodes[upper].firstChild = child;
+                nodes[child].labelStart += static_cast<uint32_t>(common);
+                nodes[child].labelLength -= static_cast<uint32_t>(common);
+                nodes[child].nextSibling = NONE;
+                link(node, prev, upper);
+                child = upper;
+            }
+            node = child;
+            pos += common;
+        }
+
+        Posting posting = {book, nodes[node].firstPosting};
+        uint32_t slot;
+        if (!freePostings.empty()) {
+            slot = freePostings.back();
+            freePostings.pop_back();
+            postings[slot] = posting;
+        } else {
+            slot = static_cast<uint32_t>(postings.size());
+            postings.push_back(posting);
+        }
+        nodes[node].firstPosting = slot;
+    }
+
+    void erase(const string& key, uint32_t book) {
+        if (key.empty()) return;
+        // Path of (node, parent, previous sibling) from the root to the key
+        struct Step { uint32_t node, parent, prev; };
+        vector<Step> path;
+        uint32_t node = 0;
+        size_t pos = 0;
+        while (pos < key.size()) {
+            uint32_t prev;
+            uint32_t child = findChild(node, key[pos], prev);
+            if (child == NONE || matchLabel(child, key, pos) != nodes[child].labelLength) return;
+            path.push_back(Step{child, node, prev});
+            pos += nodes[child].labelLength;
+            node = child;
+        }
+
+        uint32_t prevPosting = NONE;
+        uint32_t p = nodes[node].firstPosting;
+        while (p != NONE && postings[p].book != book) {
+            prevPosting = p;
+            p = postings[p].next;
+        }
+        if (p == NONE) return;
+        if (prevPosting == NONE) nodes[node].firstPosting = postings[p].next;
+        else postings[prevPosting].next = postings[p].next;
+        freePostings.push_back(p);
+
+        // Unlink nodes that no longer lead to any key
+        while (!path.empty()) {
+            Step step = path.back();
+            const Node& n = nodes[step.node];
+            if (n.firstPosting != NONE || n.firstChild != NONE) break;
+            link(step.parent, step.prev, n.nextSibling);
+            freeNodes.push_back(step.node);
+            path.pop_back();
+        }
+    }
+
+    // Calls visit(book) for the books of every key starting with `prefix`,
+    // in key order, until visit returns false
+    template <typename Visit>
+    void forEachWithPrefix(const string& prefix, Visit visit) const {
+        uint32_t node = 0;
+        size_t pos = 0;
+        while (pos < prefix.size()) {
+            uint32_t prev;
+            uint32_t child = findChild(node, prefix[pos], prev);
+            if (child == NONE) return;
+            size_t common = matchLabel(child, prefix, pos);
+            if (common < nodes[child].labelLength && pos + common < prefix.size()) return;
+            pos += common;
+            node = child;
+        }
+
+        // Preorder walk of the subtree; its root's siblings are not part of it
+        vector<uint32_t> stack(1, node);
+        while (!stack.empty()) {
+            uint32_t current = stack.back();
+            stack.pop_back();
+            for (uint32_t p = nodes[current].firstPosting; p != NONE; p = postings[p].next) {
+                if (!visit(postings[p].book)) return;
+            }
+            if (current != node && nodes[current].nextSibling != NONE) stack.push_back(nodes[current].nextSibling);
+            if (nodes[current].firstChild != NONE) stack.push_back(nodes[current].firstChild);
+        }
+    }
+};
+
+// Handles kept in sorted order as a list of blocks of at most 2 * BLOCK
+// entries, so an insert or erase moves at most one block and a page from
+// any position costs a binary search plus the page. `Less` must order the
+// handles totally. Positions are found with a predicate rather than a key,
+// so a cursor stays usable after the row it points at is removed.
+template <typename Less>
+class SortedIndex {
+private:
+    static const size_t BLOCK = 512;
+    vector<vector<uint32_t>> blocks;
+    Less less;
+    size_t count = 0;
+
+    // Replace the contents with handles already in order
+    void fill(const vector<uint32_t>& sorted) {
+        clear();
+        for (size_t i = 0; i < sorted.size(); i += BLOCK) {
+            blocks.emplace_back(sorted.begin() + i, sorted.begin() + min(sorted.size(), i + BLOCK));
+        }
+        count = sorted.size();
+    }
+
+    // Block that holds `handle` or where it belongs
+    size_t blockFor(uint32_t handle) const {
+        auto it = partition_point(blocks.begin(), blocks.end(),
+                                  [&](const vector<uint32_t>& block) { return less(block.back(), handle); });
+        if (it == blocks.end()) it--;
+        return it - blocks.begin();
+    }
+
+public:
+    struct Position {
+        size_t block, offset;
+    };
+
+    explicit SortedIndex(Less order) : less(order) {}
+
+    size_t size() const { return count; }
+
+    void clear() {
+        blocks.clear();
+        count = 0;
+    }
+
+    // Replace the contents; one sort instead of an insert per handle
+    void assign(vector<uint32_t> handles) {
+        sort(handles.begin(), handles.end(), less);
+        fill(handles);
+    }
+
+    // Every handle, in order
+    vector<uint32_t> handles() const {
+        vector<uint32_t> all;
+        all.reserve(count);
+        for (const vector<uint32_t>& block : blocks) all.insert(all.end(), block.begin(), block.end());
+        return all;
+    }
+
+    // Add a batch of new handles with one sort and a linear merge
+    void insertMany(vector<uint32_t> handles) {
+        sort(handles.begin(), handles.end(), less);
+        vector<uint32_t> existing = this->handles();
+        vector<uint32_t> merged(existing.size() + handles.size());
+        merge(existing.begin(), existing.end(), handles.begin(), handles.end(), merged.begin(), less);
+        fill(merged);
+    }
+
+    void insert(uint32_t handle) {
+        count++;
+        if (blocks.empty()) {
+            blocks.emplace_back(1, handle);
+            return;
+        }
+        size_t at = blockFor(handle);
+        vector<uint32_t>& block = blocks[at];
+        block.insert(lower_bound(block.begin(), block.end(), handle, less), handle);
+        if (block.size() > 2 * BLOCK) {
+            vector<uint32_t> upper(block.begin() + BLOCK, block.end());
+            block.resize(BLOCK);
+            blocks.insert(blocks.begin() + at + 1, move(upper));
+        }
+    }
+
+    // Call before the handle's sort key changes or its slot is reused
+    void erase(uint32_t handle) {
+        if (blocks.empty()) return;
+        size_t at = blockFor(handle);
+        vector<uint32_t>& block = blocks[at];
+        auto pos = lower_bound(block.begin(), block.end(), handle, less);
+        if (pos == block.end() || *pos != handle) return;
+        block.erase(pos);
+        count--;
+        if (block.empty()) blocks.erase(blocks.begin() + at);
+    }
+
+    Position begin() const { return Position{0, 0}; }
+
+    // First position whose handle is not `before`; `before` must hold for a
+    // prefix of the order, e.g. "sorts at or before the cursor"
+    template <typename Before>
+    Position seek(Before before) const {
+        auto it = partition_point(blocks.begin(), blocks.end(),
+                                  [&](const vector<uint32_t>& block) { return before(block.back()); });
+        if (it == blocks.end()) return Position{blocks.size(), 0};
+        return Position{size_t(it - blocks.begin()), size_t(partition_point(it->begin(), it->end(), before) - it->begin())};
+    }
+
+    bool atEnd(const Position& position) const { return position.block >= blocks.size(); }
+    uint32_t at(const Position& position) const { return blocks[position.block][position.offset]; }
+
+    void advance(Position& position) const {
+        if (++position.offset == blocks[position.block].size()) {
+            position.block++;
+            position.offset = 0;
+        }
+    }
+};
+
+// Sort orders for catalog listings; ties are broken by ISBN
+enum class CatalogOrder { Isbn, Title, Year };
+
+bool parseCatalogOrder(const string& name, CatalogOrder& order) {
+    if (name == "isbn") order = CatalogOrder::Isbn;
+    else if (name == "title") order = CatalogOrder::Title;
+    else if (name == "year") order = CatalogOrder::Year;
+    else return false;
+    return true;
+}
+
+// Keyset position in a listing: the sort key and ISBN (or member ID) of
+// the last row returned. A default cursor starts at the first row.
+struct ListingCursor {
+    string title;
+    int32_t year = 0;
+    string id;
+    bool started = false;
+};
+
+// Where a book sorts relative to a (title, year, ISBN) key in an order
+int compareBookKey(const Book& item, CatalogOrder order, const string& title, int32_t year, const string& isbn) {
+    int result = 0;
+    if (order == CatalogOrder::Title) result = item.getName().compare(title);
+    else if (order == CatalogOrder::Year) result = (item.getPublicationYear() > year) - (item.getPublicationYear() < year);
+    return result ? result : item.getISBN().compare(isbn);
+}
+
+// Orders book handles by a listing order's key, reading the books from
+// any container indexed by handle
+template <typename Books>
+struct BookKeyOrder {
+    const Books* books;
+    CatalogOrder order;
+    bool operator()(uint32_t a, uint32_t b) const {
+        const Book& other = (*books)[b];
+        return compareBookKey((*books)[a], order, other.getName(), other.getPublicationYear(), other.getISBN()) < 0;
+    }
+};
+
+const size_t LISTING_PAGE_SIZE = 20;
+
+// Catalog storage whose books never move: chunks of 16K behind a fixed
+// table, so a Book& stays valid while the catalog grows. Lock-free readers
+// rely on this to read a book's ISBN, title, author and year in place.
+class BookStore {
+private:
+    static const size_t CHUNK_BITS = 14, CHUNK_SIZE = size_t(1) << CHUNK_BITS, MAX_CHUNKS = 1 << 12;
+    unique_ptr<vector<Book>> chunks[MAX_CHUNKS];   // each with capacity CHUNK_SIZE
+    size_t count = 0;
+
+public:
+    size_t size() const { return count; }
+    Book& operator[](size_t i) { return (*chunks[i >> CHUNK_BITS])[i & (CHUNK_SIZE - 1)]; }
+    const Book& operator[](size_t i) const { return (*chunks[i >> CHUNK_BITS])[i & (CHUNK_SIZE - 1)]; }
+
+    // Allocate the chunks for `total` books up front
+    void reserve(size_t total) {
+        for (size_t chunk = 0; chunk < (total + CHUNK_SIZE - 1) >> CHUNK_BITS && chunk < MAX_CHUNKS; chunk++) {
+            if (chunks[chunk]) continue;
+            chunks[chunk].reset(new vector<Book>);
+            chunks[chunk]->reserve(CHUNK_SIZE);
+        }
+    }
+
+    void push_back(Book item) {
+        if (count == MAX_CHUNKS * CHUNK_SIZE) throw length_error("catalog is full");
+        reserve(count + 1);
+        chunks[count >> CHUNK_BITS]->push_back(move(item));
+        count++;
+    }
+};
+
+// Availability of each catalog slot, one atomic byte per slot. A writer
+// stores a new state under the book's stripe and readers load it with no
+// lock; chunks never move, so a reader of any catalog version finds the
+// slots it knows of. Growing needs the exclusive catalogLock.
+class SlotStates {
+private:
+    static const size_t CHUNK_BITS = 14, CHUNK_SIZE = size_t(1) << CHUNK_BITS, MAX_CHUNKS = 1 << 12;
+    unique_ptr<atomic<Availability>[]> chunks[MAX_CHUNKS];
+
+    atomic<Availability>& at(size_t i) const { return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)]; }
+
+public:
+    Availability get(size_t i) const { return at(i).load(memory_order_acquire); }
+    void set(size_t i, Availability state) { at(i).store(state, memory_order_release); }
+
+    // Allocate the chunks for slots [0, total)
+    void reserve(size_t total) {
+        for (size_t chunk = 0; chunk < (total + CHUNK_SIZE - 1) >> CHUNK_BITS && chunk < MAX_CHUNKS; chunk++) {
+            if (chunks[chunk]) continue;
+            chunks[chunk].reset(new atomic<Availability>[CHUNK_SIZE]);
+            for (size_t i = 0; i < CHUNK_SIZE; i++) chunks[chunk][i].store(Availability::Available, memory_order_relaxed);
+        }
+    }
+};
+
+// Epoch-based reclamation for data published to lock-free readers. A
+// reader pins the global epoch in its thread's slot while it uses a
+// published version; a writer that replaces a version retires it at the
+// epoch of the moment and frees it once no slot is pinned at or before
+// that epoch. Readers never wait. Pins nest within a thread.
+class ReaderEpochs {
+public:
+    static const size_t SLOTS = 256;
+
+private:
+    static const uint64_t IDLE = 0;
+
+    // Padded so readers on different cores do not share a cache line
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{0};
+        atomic<bool> owned{false};
+    };
+    static Slot slots[SLOTS];
+    static atomic<uint64_t> current;
+
+    // The calling thread's slot, claimed on first use and given back when
+    // the thread exits; more than SLOTS reading threads wait for a slot
+    struct ThreadSlot {
+        Slot* slot = nullptr;
+        unsigned depth = 0;
+        ~ThreadSlot() { if (slot) slot->owned.store(false, memory_order_release); }
+    };
+
+    static ThreadSlot& threadSlot() {
+        thread_local ThreadSlot mine;
+        while (!mine.slot) {
+            for (Slot& slot : slots) {
+                bool expected = false;
+                if (slot.owned.compare_exchange_strong(expected, true, memory_order_acquire)) {
+                    mine.slot = &slot;
+                    break;
+                }
+            }
+            if (!mine.slot) this_thread::yield();
+        }
+        return mine;
+    }
+
+public:
+    static void pin() {
+        ThreadSlot& mine = threadSlot();
+        if (mine.depth++ == 0) mine.slot->epoch.store(current.load());
+    }
+
+    static void unpin() {
+        ThreadSlot& mine = threadSlot();
+        if (--mine.depth == 0) mine.slot->epoch.store(IDLE, memory_order_release);
+    }
+
+    // Move to a new epoch after unpublishing a version; returns the epoch
+    // to retire the version at
+    static uint64_t advance() { return current.fetch_add(1); }
+
+    // A version retired at an epoch below this is not visible to any reader
+    static uint64_t oldestPinned() {
+        uint64_t oldest = UINT64_MAX;
+        for (const Slot& slot : slots) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != IDLE && epoch < oldest) oldest = epoch;
+        }
+        return oldest;
+    }
+};
+
+ReaderEpochs::Slot ReaderEpochs::slots[ReaderEpochs::SLOTS];
+atomic<uint64_t> ReaderEpochs::current{1};
+
+// An array whose copies share storage. A copy costs one pointer per 64K
+// elements, and set() copies only the 1024-element leaf and the branch on
+// the element's path, so older copies keep the old value.
+template <typename T>
+class PersistentArray {
+private:
+    static const size_t LEAF_BITS = 10, BRANCH_BITS = 6;
+    static const size_t LEAF = size_t(1) << LEAF_BITS, BRANCH = size_t(1) << BRANCH_BITS;
+    typedef vector<T> Leaf;
+    typedef vector<shared_ptr<const Leaf>> Branch;
+    vector<shared_ptr<const Branch>> root;
+    size_t count = 0;
+
+    static size_t top(size_t i) { return i >> (LEAF_BITS + BRANCH_BITS); }
+    static size_t middle(size_t i) { return (i >> LEAF_BITS) & (BRANCH - 1); }
+
+public:
+    size_t size() const { return count; }
+
+    const T& operator[](size_t i) const { return (*(*root[top(i)])[middle(i)])[i & (LEAF - 1)]; }
+
+    void set(size_t i, T value) {
+        shared_ptr<Branch> branch = make_shared<Branch>(*root[top(i)]);
+        shared_ptr<Leaf> leaf = make_shared<Leaf>(*(*branch)[middle(i)]);
+        (*leaf)[i & (LEAF - 1)] = move(value);
+        (*branch)[middle(i)] = move(leaf);
+        root[top(i)] = move(branch);
+    }
+
+    void push_back(T value) {
+        size_t i = count;
+        if (top(i) == root.size()) root.push_back(make_shared<Branch>());
+        shared_ptr<Branch> branch = make_shared<Branch>(*root[top(i)]);
+        if (middle(i) == branch->size()) branch->push_back(make_shared<Leaf>());
+        shared_ptr<Leaf> leaf = make_shared<Leaf>(*(*branch)[middle(i)]);
+        leaf->push_back(move(value));
+        (*branch)[middle(i)] = move(leaf);
+        root[top(i)] = move(branch);
+        count++;
+    }
+
+    // Replace the contents without copying a leaf per element
+    void assign(const vector<T>& values) {
+        root.clear();
+        for (size_t first = 0; first < values.size(); first += LEAF) {
+            if (middle(first) == 0) root.push_back(make_shared<Branch>());
+            auto end = values.begin() + min(values.size(), first + LEAF);
+            const_pointer_cast<Branch>(root.back())->push_back(make_shared<Leaf>(values.begin() + first, end));
+        }
+        count = values.size();
+    }
+};
+
+// Search and listing indexes as of a catalog version: token -> books with
+// the token, and the books in each CatalogOrder. See CatalogVersion.
+struct CatalogIndex {
+    map<string, vector<BookHandle>> tokens;
+    vector<uint32_t> listings[3];
+
+    size_t books() const { return listings[0].size(); }
+};
+
+// An immutable state of the catalog for lock-free readers. Writers publish
+// a new version for every structural change, sharing everything the change
+// leaves alone:
+// - Books are read in place from the BookStore. A removed book's slot is
+//   not reused while any published version can still see it.
+// - Whether each slot holds a book is a PersistentArray, so an add or a
+//   removal copies one small leaf.
+// - Availability is not versioned: every version reads the shared
+//   SlotStates, so a checkout or return stores one byte and publishes
+//   nothing, and readers see each book's current state.
+// - The indexes are a base, copied from the live indexes now and then, and
+//   a small delta of books added since, copied on each add. Entries of
+//   books removed since the base stay, and readers skip them.
+struct CatalogVersion {
+    struct Slot {
+        bool live;
+    };
+
+    const BookStore* books;
+    const SlotStates* states;
+    PersistentArray<Slot> slots;
+    shared_ptr<const CatalogIndex> base, delta;
+    size_t liveBooks = 0;
+    size_t removedSinceBase = 0;
+};
+
+// Books added or removed since the index base before it is rebuilt
+const size_t CATALOG_DELTA_LIMIT = 1024;
+
+// A reader's point-in-time view of the catalog: the version current when
+// it was taken, pinned until it is destroyed. Taking and using one costs no
+// lock, and writers never wait for it.
+class CatalogSnapshot {
+private:
+    const CatalogVersion* version;
+    bool pinned = true;
+
+    bool live(uint32_t book) const { return version->slots[book].live; }
+
+    // Books with a token that starts with the word, in one index
+    void appendWordMatches(const CatalogIndex& index, const string& word, vector<BookHandle>& out,
+                           size_t& lists) const {
+        for (auto it = index.tokens.lower_bound(word);
+             it != index.tokens.end() && it->first.compare(0, word.size(), word) == 0; it++) {
+            out.insert(out.end(), it->second.begin(), it->second.end());
+            lists++;
+        }
+    }
+
+    // First position in a listing after the cursor
+    size_t seek(const vector<uint32_t>& listing, CatalogOrder order, const ListingCursor& cursor) const {
+        if (!cursor.started) return 0;
+        return partition_point(listing.begin(), listing.end(), [&](uint32_t book) {
+            return compareBookKey((*version->books)[book], order, cursor.title, cursor.year, cursor.id) <= 0;
+        }) - listing.begin();
+    }
+
+public:
+    explicit CatalogSnapshot(const atomic<const CatalogVersion*>& published) {
+        ReaderEpochs::pin();
+        version = published.load();
+    }
+    CatalogSnapshot(CatalogSnapshot&& other) : version(other.version), pinned(other.pinned) { other.pinned = false; }
+    CatalogSnapshot(const CatalogSnapshot&) = delete;
+    CatalogSnapshot& operator=(const CatalogSnapshot&) = delete;
+    ~CatalogSnapshot() { if (pinned) ReaderEpochs::unpin(); }
+
+    size_t liveBooks() const { return version->liveBooks; }
+    bool contains(BookHandle book) const { return book < version->slots.size() && live(book); }
+    const Book& book(BookHandle handle) const { return (*version->books)[handle]; }
+    Availability state(BookHandle handle) const { return version->states->get(handle); }
+
+    // The book with this ISBN, NO_HANDLE if there is none
+    BookHandle find(const string& isbn) const {
+        for (const CatalogIndex* index : {version->base.get(), version->delta.get()}) {
+            const vector<uint32_t>& listing = index->listings[static_cast<int>(CatalogOrder::Isbn)];
+            auto it = partition_point(listing.begin(), listing.end(),
+                                      [&](uint32_t book) { return (*version->books)[book].getISBN() < isbn; });
+            for (; it != listing.end() && (*version->books)[*it].getISBN() == isbn; it++) {
+                if (live(*it)) return *it;
+            }
+        }
+        return NO_HANDLE;
+    }
+
+    // Books matching every word of the query, sorted by handle; see
+    // LibrarySystem::findMatches
+    vector<BookHandle> findMatches(const string& query) const {
+        vector<string> words = tokenize(query);
+        vector<BookHandle> result;
+        for (size_t i = 0; i < words.size(); i++) {
+            vector<BookHandle> matches;
+            size_t lists = 0;
+            appendWordMatches(*version->base, words[i], matches, lists);
+            appendWordMatches(*version->delta, words[i], matches, lists);
+            if (lists > 1) {
+                sort(matches.begin(), matches.end());
+                matches.erase(unique(matches.begin(), matches.end()), matches.end());
+            }
+            if (version->removedSinceBase) {
+                matches.erase(remove_if(matches.begin(), matches.end(), [this](BookHandle book) { return !live(book); }),
+                              matches.end());
+            }
+
+            if (i == 0) {
+                result.swap(matches);
+            } else {
+                vector<BookHandle> both;
+                set_intersection(result.begin(), result.end(), matches.begin(), matches.end(), back_inserter(both));
+                result.swap(both);
+            }
+            if (result.empty()) break;
+        }
+        return result;
+    }
+
+    // A listing page; see LibrarySystem::writeCatalogPage. Merges the base
+    // and delta listings from the cursor on.
+    size_t writeCatalogPage(BufferedWriter& out, CatalogOrder order, ListingCursor& cursor, size_t pageSize) const {
+        const vector<uint32_t>& base = version->base->listings[static_cast<int>(order)];
+        const vector<uint32_t>& delta = version->delta->listings[static_cast<int>(order)];
+        BookKeyOrder<BookStore> less{version->books, order};
+        size_t i = seek(base, order, cursor), j = seek(delta, order, cursor), written = 0;
+        while (written < pageSize) {
+            while (i < base.size() && !live(base[i])) i++;
+            while (j < delta.size() && !live(delta[j])) j++;
+            if (i == base.size() && j == delta.size()) break;
+            uint32_t handle = j == delta.size() || (i < base.size() && less(base[i], delta[j])) ? base[i++] : delta[j++];
+
+            const Book& item = (*version->books)[handle];
+            out << item.getISBN() << " - " << item.getName() << " (" << item.getPublicationYear()
+                << ", " << availabilityName(state(handle)) << ")\n";
+            cursor.title = item.getName();
+            cursor.year = item.getPublicationYear();
+            cursor.id = item.getISBN();
+            cursor.started = true;
+            written++;
+        }
+        return written;
+    }
+};
+
+// Outcome of a circulation operation
+enum class OpStatus {
+    Ok,
+    NotFound,
+    AlreadyBorrowed,
+    ReservedByOther,
+    NotEligible,
+    NotCheckedOut,
+    NotBorrowedByMember,
+    NotReservable,
+    AlreadyReserved
+};
+
+const char* statusCode(OpStatus status) {
+    switch (status) {
+        case OpStatus::Ok: return "ok";
+        case OpStatus::NotFound: return "not_found";
+        case OpStatus::AlreadyBorrowed: return "already_borrowed";
+        case OpStatus::ReservedByOther: return "reserved_by_other";
+        case OpStatus::NotEligible: return "not_eligible";
+        case OpStatus::NotCheckedOut: return "not_checked_out";
+        case OpStatus::NotBorrowedByMember: return "not_borrowed_by_member";
+        case OpStatus::NotReservable: return "not_reservable";
+        case OpStatus::AlreadyReserved: return "already_reserved";
+    }
+    return "unknown";
+}
+
+// Menu text for a failed operation
+const char* statusMessage(OpStatus status) {
+    switch (status) {
+        case OpStatus::Ok: return "Done.";
+        case OpStatus::NotFound: return "Item not found in catalog.";
+        case OpStatus::AlreadyBorrowed: return "Item is already checked out.";
+        case OpStatus::ReservedByOther: return "Item is reserved by another member.";
+        case OpStatus::NotEligible: return "You are not eligible to borrow at this time.";
+        case OpStatus::NotCheckedOut: return "Item is not checked out.";
+        case OpStatus::NotBorrowedByMember: return "You have not checked out this item.";
+        case OpStatus::NotReservable: return "Item is not eligible for reservation.";
+        case OpStatus::AlreadyReserved: return "You have already reserved this item.";
+    }
+    return "Unknown error.";
+}
+
+typedef chrono::system_clock::time_point TimePoint;
+const chrono::hours ONE_DAY(24);
+
+// Where the library gets the current time for checkouts, returns, late
+// fees and the borrowing blocks. The wall clock unless the library is
+// given another, e.g. a ManualClock to run months of circulation in
+// seconds.
+class Clock {
+public:
+    virtual ~Clock() {}
+    virtual TimePoint now() const = 0;
+
+    static const Clock& system();
+};
+
+class SystemClock : public Clock {
+public:
+    TimePoint now() const override { return chrono::system_clock::now(); }
+};
+
+const Clock& Clock::system() {
+    static SystemClock clock;
+    return clock;
+}
+
+// A clock that only moves when told to; safe to read from any thread
+class ManualClock : public Clock {
+private:
+    atomic<TimePoint::rep> ticks;
+
+public:
+    explicit ManualClock(TimePoint start) : ticks(start.time_since_epoch().count()) {}
+    TimePoint now() const override { return TimePoint(TimePoint::duration(ticks.load())); }
+    void set(TimePoint when) { ticks = when.time_since_epoch().count(); }
+    void advance(TimePoint::duration by) { ticks += by.count(); }
+};
+
+// Prefix completion looks at no more than this many candidates per result
+const size_t COMPLETION_SCAN_FACTOR = 16;
+
+// Whole days from one time to a later one
+int daysBetween(TimePoint from, TimePoint to) {
+    return chrono::duration_cast<chrono::hours>(to - from).count() / 24;
+}
+
+// A deadline on an active loan. A book has one borrower at a time, so the
+// book handle identifies the loan.
+struct LoanTimer {
+    TimePoint when;
+    BookHandle book;
+    MemberHandle member;
+
+    bool operator<(const LoanTimer& other) const {
+        return when != other.when ? when < other.when : book < other.book;
+    }
+};
+
+struct OverdueLoan {
+    string memberId, isbn;
+    int daysOverdue;
+};
+
+// Circulation history: one row per loan, stored column by column so a
+// report reads only the columns it needs, in branch-free loops the
+// compiler can vectorize. A row is open, with return time 0, from checkout
+// until return. Closed rows are appended to history.csv at the next
+// export as isbn,member,checkout,return,fee; open rows are rebuilt from
+// the active loans at startup. Has its own mutex, taken after any stripe.
+class CirculationHistory {
+public:
+    // Kind column value for a member who is no longer registered
+    static const uint8_t UNKNOWN_KIND = 3;
+
+    struct LoanDuration {
+        const char* memberType;
+        size_t loans;
+        double averageDays;
+    };
+
+private:
+    StringDictionary isbns;
+    vector<uint32_t> isbnColumn, memberColumn;
+    vector<uint8_t> kindColumn;
+    vector<int64_t> checkoutColumn, returnColumn;
+    vector<double> feeColumn;
+    unordered_map<uint64_t, uint32_t> openRows;   // (member, isbn) -> row
+    vector<uint32_t> unsaved;                     // closed since the last export
+    mutex lock;
+
+    // Checkouts and returns not yet in the columns, sharded by member code
+    // so circulation records them without a shared mutex. A member's
+    // events share a shard and stay in order; the shards are merged under
+    // `lock` before every read and export.
+    struct PendingEvent {
+        string isbn;
+        uint32_t member;
+        uint8_t kind;
+        int64_t when;
+        double fee;
+        bool returned;
+    };
+    static const size_t SHARDS = 64;
+    struct Shard {
+        mutex lock;
+        vector<PendingEvent> events;
+        char padding[64];   // keeps neighbouring shards off one cache line
+    };
+    Shard shards[SHARDS];
+
+    static uint64_t loanKey(uint32_t member, uint32_t isbn) { return uint64_t(member) << 32 | isbn; }
+
+    static int64_t seconds(TimePoint when) {
+        return chrono::duration_cast<chrono::seconds>(when.time_since_epoch()).count();
+    }
+
+    uint32_t addRow(const string& isbn, uint32_t member, uint8_t kind, int64_t checkout, int64_t returned,
+                    double fee) {
+        isbnColumn.push_back(isbns.intern(isbn));
+        memberColumn.push_back(member);
+        kindColumn.push_back(kind);
+        checkoutColumn.push_back(checkout);
+        returnColumn.push_back(returned);
+        feeColumn.push_back(fee);
+        return static_cast<uint32_t>(isbnColumn.size() - 1);
+    }
+
+    // Close the member's open row for the book
+    void closeRow(const PendingEvent& event) {
+        uint32_t book = isbns.find(event.isbn);
+        if (book == StringDictionary::NONE) return;
+        auto it = openRows.find(loanKey(event.member, book));
+        if (it == openRows.end()) return;
+        uint32_t row = it->second;
+        openRows.erase(it);
+        returnColumn[row] = event.when;
+        feeColumn[row] = event.fee;
+        unsaved.push_back(row);
+    }
+
+    // Move the pending events into the columns; caller holds `lock`
+    void mergePending() {
+        for (Shard& shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            for (const PendingEvent& event : shard.events) {
+                if (event.returned) {
+                    closeRow(event);
+                    continue;
+                }
+                uint32_t row = addRow(event.isbn, event.member, event.kind, event.when, 0, 0);
+                openRows[loanKey(event.member, isbnColumn[row])] = row;
+            }
+            shard.events.clear();
+        }
+    }
+
+    void addPending(PendingEvent event) {
+        Shard& shard = shards[event.member % SHARDS];
+        lock_guard<mutex> guard(shard.lock);
+        shard.events.push_back(move(event));
+    }
+
+public:
+    size_t size() {
+        lock_guard<mutex> guard(lock);
+        mergePending();
+        return isbnColumn.size();
+    }
+
+    // `member` is the borrower's code in Book::memberIds
+    void recordCheckout(const string& isbn, uint32_t member, MemberKind kind, TimePoint when) {
+        addPending(PendingEvent{isbn, member, static_cast<uint8_t>(kind), seconds(when), 0, false});
+    }
+
+    // Close the member's open row for the book; `fee` is all the loan was
+    // charged, including days the nightly accrual already billed
+    void recordReturn(const string& isbn, uint32_t member, TimePoint when, double fee) {
+        addPending(PendingEvent{isbn, member, 0, seconds(when), fee, true});
+    }
+
+    // Load the closed rows of a history.csv; kindOf(memberId) gives the
+    // member's kind, UNKNOWN_KIND if they are gone. Malformed lines, such
+    // as a header, are skipped.
+    template <typename KindOf>
+    void load(const string& path, KindOf kindOf) {
+        MappedFile file;
+        if (!file.open(path)) return;
+        CsvScanner scanner(file);
+        FieldView f[5];
+        long long checkout, returned;
+        double fee;
+        lock_guard<mutex> guard(lock);
+        while (scanner.nextRecord(f, 5)) {
+            if (f[0].empty() || !parseInt64(f[2], checkout) || !parseInt64(f[3], returned) || returned == 0 ||
+                !parseDouble(f[4], fee)) continue;
+            string memberId = f[1].str();
+            addRow(f[0].str(), Book::memberIds.intern(memberId), kindOf(memberId), checkout, returned, fee);
+        }
+    }
+
+    // Append the rows closed since the last call, then sync
+    bool appendUnsaved(const string& path) {
+        lock_guard<mutex> guard(lock);
+        mergePending();
+        if (unsaved.empty()) return true;
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return false;
+        bool ok;
+        {
+            BufferedWriter out(fd, 1 << 20);
+            for (uint32_t row : unsaved) {
+                out << isbns.lookup(isbnColumn[row]) << ',' << Book::memberIds.lookup(memberColumn[row]) << ','
+                    << static_cast<long long>(checkoutColumn[row]) << ','
+                    << static_cast<long long>(returnColumn[row]) << ',' << feeColumn[row] << '\n';
+            }
+            out.flush();
+            ok = out.good();
+        }
+        ok = fdatasync(fd) == 0 && ok;
+        ::close(fd);
+        if (ok) unsaved.clear();
+        return ok;
+    }
+
+    // ISBNs checked out most often in [from, to), most first
+    vector<pair<string, size_t>> mostBorrowed(TimePoint from, TimePoint to, size_t limit) {
+        lock_guard<mutex> guard(lock);
+        mergePending();
+        int64_t start = seconds(from), stop = seconds(to);
+        const uint32_t* isbn = isbnColumn.data();
+        const int64_t* checkout = checkoutColumn.data();
+        vector<uint32_t> counts(isbns.size(), 0);
+        for (size_t i = 0, n = isbnColumn.size(); i < n; i++) {
+            counts[isbn[i]] += (checkout[i] >= start) & (checkout[i] < stop);
+        }
+
+        vector<pair<uint32_t, uint32_t>> ranked;   // (count, isbn code)
+        for (uint32_t code = 0; code < counts.size(); code++) {
+            if (counts[code]) ranked.push_back(make_pair(counts[code], code));
+        }
+        size_t top = min(limit, ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(),
+                     [this](const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) {
+                         return a.first != b.first ? a.first > b.first : isbns.lookup(a.second) < isbns.lookup(b.second);
+                     });
+        vector<pair<string, size_t>> result;
+        for (size_t i = 0; i < top; i++) result.push_back(make_pair(isbns.lookup(ranked[i].second), ranked[i].first));
+        return result;
+    }
+
+    // Average length of the returned loans of each member type. One pass
+    // per type keeps every loop a plain masked sum.
+    vector<LoanDuration> averageLoanDays() {
+        lock_guard<mutex> guard(lock);
+        mergePending();
+        const uint8_t* kind = kindColumn.data();
+        const int64_t* checkout = checkoutColumn.data();
+        const int64_t* returned = returnColumn.data();
+        size_t n = kindColumn.size();
+
+        vector<LoanDuration> result;
+        for (uint8_t k = 0; k <= UNKNOWN_KIND; k++) {
+            int64_t total = 0, loans = 0;
+            for (size_t i = 0; i < n; i++) {
+                int64_t hit = (kind[i] == k) & (returned[i] != 0);
+                total += hit * (returned[i] - checkout[i]);
+                loans += hit;
+            }
+            if (loans == 0) continue;
+            const char* type = k == UNKNOWN_KIND ? "unknown" : MEMBER_POLICIES[k].typeName;
+            result.push_back(LoanDuration{type, static_cast<size_t>(loans), total / double(loans) / 86400.0});
+        }
+        return result;
+    }
+
+    // Late fees charged on the loans returned in each calendar month (UTC),
+    // as ("YYYY-MM", revenue) in date order. Days map to months through a
+    // table, so the scan does no calendar arithmetic.
+    vector<pair<string, double>> revenueByMonth() {
+        lock_guard<mutex> guard(lock);
+        mergePending();
+        const int64_t* returned = returnColumn.data();
+        const double* fee = feeColumn.data();
+        size_t n = returnColumn.size();
+
+        int64_t firstDay = INT64_MAX, lastDay = INT64_MIN;
+        for (size_t i = 0; i < n; i++) {
+            if (!returned[i]) continue;
+            firstDay = min(firstDay, returned[i] / 86400);
+            lastDay = max(lastDay, returned[i] / 86400);
+        }
+        vector<pair<string, double>> result;
+        if (firstDay > lastDay) return result;
+
+        vector<uint32_t> monthOfDay(lastDay - firstDay + 1);
+        int previous = -1;
+        for (int64_t day = firstDay; day <= lastDay; day++) {
+            time_t at = static_cast<time_t>(day * 86400);
+            struct tm date;
+            gmtime_r(&at, &date);
+            int month = date.tm_year * 12 + date.tm_mon;
+            if (month != previous) {
+                char label[32];
+                snprintf(label, sizeof(label), "%04d-%02d", date.tm_year + 1900, date.tm_mon + 1);
+                result.push_back(make_pair(string(label), 0.0));
+                previous = month;
+            }
+            monthOfDay[day - firstDay] = static_cast<uint32_t>(result.size() - 1);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (returned[i]) result[monthOfDay[returned[i] / 86400 - firstDay]].second += fee[i];
+        }
+        return result;
+    }
+};
+
+// A fuzzy search hit: the book and the edits needed to match the query
+struct FuzzyMatch {
+    BookHandle book;
+    int distance;
+};
+
+// Operations timed by the library's instrumentation
+enum class Operation { Checkout, Return, Reserve, Search, Complete, Import, Export };
+const size_t OPERATION_COUNT = 7;
+const char* const OPERATION_NAMES[OPERATION_COUNT] = {"checkout", "return", "reserve", "search", "complete", "import", "export"};
+const size_t STATUS_COUNT = static_cast<size_t>(OpStatus::AlreadyReserved) + 1;
+
+// HDR-style latency histogram: 16 linear sub-buckets per power of two of
+// nanoseconds, so a bucket's bound is within 1/16 of every value in it.
+// Recording is lock-free, so desk threads do not contend on it.
+class LatencyHistogram {
+private:
+    static const int SUB_BITS = 4;
+    static const uint64_t SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_EXPONENT = 40;  // about 18 minutes; longer values share the last bucket
+    static const size_t BUCKETS = SUB_COUNT + (MAX_EXPONENT - SUB_BITS + 1) * SUB_COUNT;
+
+    atomic<uint64_t> counts[BUCKETS];
+    atomic<uint64_t> total{0}, sum{0}, maximum{0};
+
+    static size_t bucketOf(uint64_t nanos) {
+        if (nanos < SUB_COUNT) return nanos;
+        int exponent = 63 - __builtin_clzll(nanos);
+        if (exponent > MAX_EXPONENT) return BUCKETS - 1;
+        return SUB_COUNT + (exponent - SUB_BITS) * SUB_COUNT + ((nanos >> (exponent - SUB_BITS)) - SUB_COUNT);
+    }
+
+    // Largest value that lands in a bucket
+    static uint64_t bucketLimit(size_t bucket) {
+        if (bucket < SUB_COUNT) return bucket;
+        size_t shift = (bucket - SUB_COUNT) / SUB_COUNT;
+        uint64_t sub = (bucket - SUB_COUNT) % SUB_COUNT;
+        return ((SUB_COUNT + sub + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() {
+        for (atomic<uint64_t>& count : counts) count = 0;
+    }
+
+    void record(uint64_t nanos) {
+        counts[bucketOf(nanos)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(nanos, memory_order_relaxed);
+        uint64_t seen = maximum.load(memory_order_relaxed);
+        while (nanos > seen && !maximum.compare_exchange_weak(seen, nanos, memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return total.load(memory_order_relaxed); }
+    uint64_t totalNanos() const { return sum.load(memory_order_relaxed); }
+    uint64_t maxNanos() const { return maximum.load(memory_order_relaxed); }
+
+    // Value that the given fraction of recordings are at or below
+    uint64_t percentile(double fraction) const {
+        uint64_t recorded = count();
+        if (recorded == 0) return 0;
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * recorded)));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; b++) {
+            seen += counts[b].load(memory_order_relaxed);
+            if (seen >= rank) return min(bucketLimit(b), maxNanos());
+        }
+        return maxNanos();
+    }
+
+    // Recordings whose bucket lies entirely at or below the bound
+    uint64_t countAtOrBelow(uint64_t nanos) const {
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS && bucketLimit(b) <= nanos; b++) seen += counts[b].load(memory_order_relaxed);
+        return seen;
+    }
+};
+
+// Call counts by outcome and latency for each timed operation
+class LibraryMetrics {
+private:
+    struct OperationStats {
+        atomic<uint64_t> outcomes[STATUS_COUNT];
+        LatencyHistogram latency;
+
+        OperationStats() {
+            for (atomic<uint64_t>& count : outcomes) count = 0;
+        }
+    };
+    OperationStats stats[OPERATION_COUNT];
+
+public:
+    void record(Operation op, uint64_t nanos, OpStatus status) {
+        OperationStats& entry = stats[static_cast<size_t>(op)];
+        entry.outcomes[static_cast<size_t>(status)].fetch_add(1, memory_order_relaxed);
+        entry.latency.record(nanos);
+    }
+
+    const LatencyHistogram& latency(Operation op) const { return stats[static_cast<size_t>(op)].latency; }
+
+    // Prometheus text exposition format
+    string prometheus() const {
+        static const double BOUNDS[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+                                        1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+        ostringstream out;
+        out << "# HELP library_operations_total Library operations by outcome.\n"
+            << "# TYPE library_operations_total counter\n";
+        for (size_t op = 0; op < OPERATION_COUNT; op++) {
+            for (size_t status = 0; status < STATUS_COUNT; status++) {
+                uint64_t count = stats[op].outcomes[status].load(memory_order_relaxed);
+                if (count == 0) continue;
+                out << "library_operations_total{op=\"" << OPERATION_NAMES[op] << "\",status=\""
+                    << statusCode(static_cast<OpStatus>(status)) << "\"} " << count << "\n";
+            }
+        }
+        out << "# HELP library_operation_duration_seconds Library operation latency.\n"
+            << "# TYPE library_operation_duration_seconds histogram\n";
+        for (size_t op = 0; op < OPERATION_COUNT; op++) {
+            const LatencyHistogram& latency = stats[op].latency;
+            if (latency.count() == 0) continue;
+            string label = string("op=\"") + OPERATION_NAMES[op] + "\"";
+            for (double bound : BOUNDS) {
+                out << "library_operation_duration_seconds_bucket{" << label << ",le=\"" << bound << "\"} "
+                    << latency.countAtOrBelow(static_cast<uint64_t>(bound * 1e9)) << "\n";
+            }
+            out << "library_operation_duration_seconds_bucket{" << label << ",le=\"+Inf\"} " << latency.count() << "\n"
+                << "library_operation_duration_seconds_sum{" << label << "} " << latency.totalNanos() / 1e9 << "\n"
+                << "library_operation_duration_seconds_count{" << label << "} " << latency.count() << "\n";
+        }
+        return out.str();
+    }
+
+    // One object per operation: calls, outcomes and latency percentiles in nanoseconds
+    string json() const {
+        ostringstream out;
+        out << "{";
+        for (size_t op = 0; op < OPERATION_COUNT; op++) {
+            const LatencyHistogram& latency = stats[op].latency;
+            out << (op ? "," : "") << "\"" << OPERATION_NAMES[op] << "\":{\"calls\":" << latency.count() << ",\"outcomes\":{";
+            bool first = true;
+            for (size_t status = 0; status < STATUS_COUNT; status++) {
+                uint64_t count = stats[op].outcomes[status].load(memory_order_relaxed);
+                if (count == 0) continue;
+                out << (first ? "" : ",") << "\"" << statusCode(static_cast<OpStatus>(status)) << "\":" << count;
+                first = false;
+            }
+            out << "},\"latency_ns\":{\"mean\":" << (latency.count() ? latency.totalNanos() / latency.count() : 0)
+                << ",\"p50\":" << latency.percentile(0.5) << ",\"p90\":" << latency.percentile(0.9)
+                << ",\"p99\":" << latency.percentile(0.99) << ",\"p999\":" << latency.percentile(0.999)
+                << ",\"max\":" << latency.maxNanos() << "}}";
+        }
+        out << "}";
+        return out.str();
+    }
+};
+
+// Records one operation's latency and outcome when it goes out of scope
+class OperationTimer {
+private:
+    LibraryMetrics& metrics;
+    Operation op;
+    chrono::steady_clock::time_point start;
+    OpStatus status = OpStatus::Ok;
+
+public:
+    OperationTimer(LibraryMetrics& metrics_val, Operation op_val)
+        : metrics(metrics_val), op(op_val), start(chrono::steady_clock::now()) {}
+    ~OperationTimer() {
+        metrics.record(op, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(), status);
+    }
+
+    OpStatus finish(OpStatus outcome) { return status = outcome; }
+};
+
+// One bit per catalog slot, e.g. the books in one availability state. Bits
+// are flipped atomically, so books under different lock stripes can share
+// a word; growing the bitmap needs the exclusive catalogLock.
+class SlotBitmap {
+private:
+    unique_ptr<atomic<uint64_t>[]> bits;
+    size_t words = 0;
+
+public:
+    size_t wordCount() const { return words; }
+    uint64_t word(size_t i) const { return bits[i].load(memory_order_relaxed); }
+    void set(size_t slot) { bits[slot >> 6].fetch_or(uint64_t(1) << (slot & 63), memory_order_relaxed); }
+    void clear(size_t slot) { bits[slot >> 6].fetch_and(~(uint64_t(1) << (slot & 63)), memory_order_relaxed); }
+
+    // Make room for slots [0, slots); new bits are clear
+    void reserve(size_t slots) {
+        size_t needed = (slots + 63) / 64;
+        if (needed <= words) return;
+        size_t grown = max(needed, words * 2);
+        unique_ptr<atomic<uint64_t>[]> larger(new atomic<uint64_t>[grown]);
+        for (size_t i = 0; i < grown; i++) larger[i].store(i < words ? word(i) : 0, memory_order_relaxed);
+        bits = move(larger);
+        words = grown;
+    }
+};
+
+// A structured catalog query; a field left at its default matches every
+// book. Years are inclusive.
+struct CatalogFilter {
+    string publisher;
+    int32_t fromYear = INT32_MIN, toYear = INT32_MAX;
+    vector<Availability> states;
+};
+
+// Library class implementation
+class LibrarySystem {
+    private:
+        // Catalog slots: removed books leave a dead slot that addbook reuses
+        BookStore catalog;
+        SlotStates slotStates;   // each slot's availability for lock-free readers
+        vector<bool> catalogLive;
+        vector<BookHandle> freeBookSlots;
+        unordered_map<string, BookHandle> isbnIndex;
+
+        // Lock-free reads: the catalog version searches and listings see,
+        // and the versions replaced while a reader may still hold them.
+        // publishLock serializes the structural changes and index rebuilds
+        // that publish; circulation never takes it.
+        atomic<const CatalogVersion*> publishedCatalog{nullptr};
+        mutex publishLock;
+        deque<pair<uint64_t, const CatalogVersion*>> retiredVersions;
+
+        // Slots of books removed since the index base was built, which it
+        // still lists, then of bases being retired: a slot is reused only
+        // once no reader can hold a version that shows its old book
+        vector<BookHandle> retiredBookSlots;
+        deque<pair<uint64_t, vector<BookHandle>>> pendingBookSlots;
+        atomic<bool> indexRebuildDue{false};
+
+        // Inverted index: title/author token -> sorted posting list of books.
+        // Ordered so a query word can match every token it is a prefix of.
+        map<string, vector<BookHandle>> tokenIndex;
+
+        // Trigrams of the tokenIndex vocabulary for typo-tolerant search
+        FuzzyTokenIndex fuzzyTokens;
+
+        // Radix trie over each book's ISBN, title and author for prefix
+        // completion; only changed under an exclusive catalogLock
+        CompletionTrie completions;
+
+        // Filter indexes: publisher code -> sorted handles, and a bitmap of
+        // the books in each availability state, kept in step by every state
+        // change. Built after loading; a removed book is in no bitmap.
+        unordered_map<uint32_t, vector<BookHandle>> booksByPublisher;
+        SlotBitmap stateBitmaps[3];
+
+        // Every loan, open and closed, for the circulation reports
+        CirculationHistory history;
+
+        // Rows of the last CSV load that named an unknown member or book
+        vector<DanglingReference> danglingReferences;
+
+        // Member slots in a pool; removed slots are reused by registerMember
+        MemberPool memberDatabase;
+        unordered_map<string, MemberHandle> memberIndex;
+
+        // Catalog and member handles in listing order, for keyset paging.
+        // Built once after loading, then kept current by the structural
+        // changes under the exclusive catalogLock.
+        typedef BookKeyOrder<BookStore> BookOrder;
+        struct MemberOrder {
+            const MemberPool* members;
+            bool operator()(uint32_t a, uint32_t b) const {
+                return (*members)[a]->getMemberId() < (*members)[b]->getMemberId();
+            }
+        };
+        SortedIndex<BookOrder> booksByIsbn{BookOrder{&catalog, CatalogOrder::Isbn}};
+        SortedIndex<BookOrder> booksByTitle{BookOrder{&catalog, CatalogOrder::Title}};
+        SortedIndex<BookOrder> booksByYear{BookOrder{&catalog, CatalogOrder::Year}};
+        SortedIndex<MemberOrder> membersById{MemberOrder{&memberDatabase}};
+
+        // Mutations are journaled once startup has loaded the snapshot
+        Journal journal;
+        bool journaling = false;
+
+        // Binary snapshot alongside the CSVs; the epoch ties it to the journal
+        bool useSnapshot;
+        unsigned long long snapshotEpoch = 0;
+
+        // Directory holding the data files
+        string dataDir;
+
+        // Time source for every date the library records or compares
+        const Clock& clock;
+
+        // Locking: structural changes (adding or removing books and members,
+        // snapshots) hold catalogLock exclusively. Circulation holds it shared
+        // and serializes per record on striped mutexes keyed by member ID and
+        // ISBN, always taking the member stripe before the book stripe.
+        static const size_t LOCK_STRIPES = 64;
+        mutable shared_timed_mutex catalogLock;
+        mutable mutex bookStripes[LOCK_STRIPES];
+        mutable mutex memberStripes[LOCK_STRIPES];
+
+        // Reservation queues: a book's first reserver is its bookedBy, the
+        // members queued behind them wait here in FIFO order. Sharded by book
+        // stripe so each map is only touched under that stripe's mutex.
+        unordered_map<BookHandle, deque<uint32_t>> waitlists[LOCK_STRIPES];
+
+        // Due-date timers over the active loans, each ordered so the next
+        // deadline is at begin(): when a loan falls due, when it starts to
+        // block its borrower, and when it next accrues a day's late fee.
+        // Sharded by the borrower's member stripe and guarded by it, so
+        // circulation times its loans without a lock of its own. Passes
+        // over every shard hold the exclusive lock or take each stripe.
+        struct LoanTimers {
+            set<LoanTimer> due, block, accrual;
+        };
+        LoanTimers loanTimers[LOCK_STRIPES];
+
+        // Records reach the journal through the background group commit
+        JournalWriter journalWriter{journal};
+        atomic<size_t> journalRecords{0};
+        atomic<bool> compactionDue{false};
+        atomic<bool> synchronousCommit{false};
+
+        // Compaction runs on its own thread, so no desk operation waits for
+        // the export and the journal writer keeps draining the queue while
+        // the compactor waits for the exclusive lock
+        mutex compactorLock;
+        condition_variable compactorWake;
+        bool stopCompactor = false;
+        thread compactor;
+
+        // Call counts, outcomes and latency of the public operations
+        mutable LibraryMetrics metrics;
+
+        // Incremental export: books and memberships carry dirty flags, member
+        // slots are flagged when added or removed, and each CSV is skipped
+        // unless its flag is set. The segment offsets of each file, known
+        // once we have written it, let clean segments be copied verbatim.
+        atomic<bool> catalogChanged{true}, membersChanged{true}, circulationChanged{true};
+        vector<bool> memberSlotDirty;
+        vector<uint64_t> bookSegments, memberSegments, loanSegments, feeSegments;
+        bool snapshotCurrent = false;
+        bool loading = false;
+
+        typedef shared_lock<shared_timed_mutex> SharedLock;
+        typedef unique_lock<shared_timed_mutex> ExclusiveLock;
+
+        size_t stripeOf(const string& isbn) const { return hash<string>()(isbn) % LOCK_STRIPES; }
+        mutex& bookStripe(const string& isbn) const { return bookStripes[stripeOf(isbn)]; }
+        size_t memberStripeOf(const string& memberId) const { return hash<string>()(memberId) % LOCK_STRIPES; }
+        mutex& memberStripe(const string& memberId) const { return memberStripes[memberStripeOf(memberId)]; }
+        LoanTimers& timersOf(const Member* member) { return loanTimers[memberStripeOf(member->getMemberId())]; }
+
+        // In synchronous commit mode, waits for the operation's journal
+        // record once the operation has released its locks; declare it
+        // before the operation's lock guards
+        struct CommitWhenDone {
+            LibrarySystem& library;
+            uint64_t sequence;
+            ~CommitWhenDone() { if (sequence && library.synchronousCommit) library.journalWriter.waitFor(sequence); }
+        };
+
+        string dataPath(const string& file) const { return dataDir + "/" + file; }
+
+        // Queue a journal record; returns its sequence number, 0 if not journaled
+        uint64_t logChange(const string& record) {
+            if (!journaling) return 0;
+            if (++journalRecords == JOURNAL_COMPACT_THRESHOLD) requestCompaction();
+            return journalWriter.enqueue(record);
+        }
+
+        // Caller holds catalogLock exclusively
+        void compactLocked() {
+            compactionDue = false;
+            snapshotEpoch++;
+            exportFiles();
+            // Loans closed since the last compaction are in the journal
+            // until it is reset, so they are appended here and not at
+            // every export
+            if (!history.appendUnsaved(dataPath("history.csv"))) {
+                cerr << "Warning: could not append to history.csv.\n";
+            }
+            journalWriter.reset(snapshotEpoch);
+            journalRecords = 0;
+        }
+
+        void requestCompaction() {
+            {
+                lock_guard<mutex> lock(compactorLock);
+                compactionDue = true;
+            }
+            compactorWake.notify_one();
+        }
+
+        void requestIndexRebuild() {
+            {
+                lock_guard<mutex> lock(compactorLock);
+                indexRebuildDue = true;
+            }
+            compactorWake.notify_one();
+        }
+
+        // Compactions and index rebuilds run here; a rebuild only needs the
+        // catalog to hold still, so desk operations carry on meanwhile
+        void runCompactor() {
+            unique_lock<mutex> lock(compactorLock);
+            while (true) {
+                compactorWake.wait(lock, [this] { return stopCompactor || compactionDue || indexRebuildDue; });
+                if (stopCompactor) return;
+                lock.unlock();
+                if (compactionDue) {
+                    ExclusiveLock exclusive(catalogLock);
+                    if (compactionDue) compactLocked();
+                }
+                if (indexRebuildDue) {
+                    SharedLock shared(catalogLock);
+                    if (indexRebuildDue.exchange(false)) rebuildCatalogVersion(false);
+                }
+                lock.lock();
+            }
+        }
+
+        // Replace the published catalog version with a copy that `change`
+        // edits, and free the replaced versions no reader can still hold.
+        // Returns the epoch the replaced version was retired at, 0 before
+        // the constructor publishes the first version.
+        template <typename Change>
+        uint64_t publish(Change change) {
+            lock_guard<mutex> lock(publishLock);
+            const CatalogVersion* current = publishedCatalog.load();
+            if (!current) return 0;
+            CatalogVersion* next = new CatalogVersion(*current);
+            change(*next);
+            publishedCatalog.store(next);
+            uint64_t retiredAt = ReaderEpochs::advance();
+            retiredVersions.emplace_back(retiredAt, current);
+            uint64_t oldest = ReaderEpochs::oldestPinned();
+            while (!retiredVersions.empty() && retiredVersions.front().first < oldest) {
+                delete retiredVersions.front().second;
+                retiredVersions.pop_front();
+            }
+            return retiredAt;
+        }
+
+        // A book's new availability, visible to readers at once; caller
+        // holds its stripe. Until the first version is published there are
+        // no readers, and rebuildCatalogVersion stores every state then.
+        void publishState(BookHandle handle) {
+            if (publishedCatalog.load(memory_order_relaxed)) slotStates.set(handle, catalog[handle].getState());
+        }
+
+        // A book added to its slot goes into the index delta; caller holds
+        // the exclusive lock
+        void publishAdded(BookHandle handle) {
+            bool rebuild = false;
+            slotStates.reserve(handle + 1);
+            slotStates.set(handle, catalog[handle].getState());
+            publish([&](CatalogVersion& next) {
+                CatalogVersion::Slot slot{true};
+                if (handle < next.slots.size()) next.slots.set(handle, slot);
+                else next.slots.push_back(slot);
+
+                shared_ptr<CatalogIndex> delta = make_shared<CatalogIndex>(*next.delta);
+                for (const string& token : bookTokens(catalog[handle])) {
+                    vector<BookHandle>& postings = delta->tokens[token];
+                    postings.insert(lower_bound(postings.begin(), postings.end(), handle), handle);
+                }
+                for (int order = 0; order < 3; order++) {
+                    vector<uint32_t>& listing = delta->listings[order];
+                    BookOrder less{&catalog, static_cast<CatalogOrder>(order)};
+                    uint32_t book = static_cast<uint32_t>(handle);
+                    listing.insert(upper_bound(listing.begin(), listing.end(), book, less), book);
+                }
+                next.delta = move(delta);
+                next.liveBooks++;
+                rebuild = next.delta->books() + next.removedSinceBase >= CATALOG_DELTA_LIMIT;
+            });
+            if (rebuild) requestIndexRebuild();
+        }
+
+        // A removed book's slot goes dead; its index entries stay until the
+        // next rebuild. False before the first version is published.
+        bool publishRemoved(BookHandle handle) {
+            bool rebuild = false;
+            uint64_t retiredAt = publish([&](CatalogVersion& next) {
+                next.slots.set(handle, CatalogVersion::Slot{false});
+                next.liveBooks--;
+                next.removedSinceBase++;
+                rebuild = next.delta->books() + next.removedSinceBase >= CATALOG_DELTA_LIMIT;
+            });
+            if (rebuild) requestIndexRebuild();
+            return retiredAt != 0;
+        }
+
+        // Search and listing indexes copied from the live ones; caller
+        // holds catalogLock
+        shared_ptr<const CatalogIndex> buildCatalogIndex() const {
+            shared_ptr<CatalogIndex> index = make_shared<CatalogIndex>();
+            index->tokens = tokenIndex;
+            index->listings[static_cast<int>(CatalogOrder::Isbn)] = booksByIsbn.handles();
+            index->listings[static_cast<int>(CatalogOrder::Title)] = booksByTitle.handles();
+            index->listings[static_cast<int>(CatalogOrder::Year)] = booksByYear.handles();
+            return index;
+        }
+
+        // Publish a new index base with an empty delta, and with allSlots
+        // the live flag and state of every slot too. The slots of books removed since the
+        // old base are freed once no reader can hold it. Caller holds
+        // catalogLock, exclusively with allSlots.
+        void rebuildCatalogVersion(bool allSlots) {
+            CatalogVersion fresh;
+            fresh.books = &catalog;
+            fresh.states = &slotStates;
+            fresh.base = buildCatalogIndex();
+            fresh.delta = make_shared<CatalogIndex>();
+            if (allSlots) {
+                slotStates.reserve(catalog.size());
+                vector<CatalogVersion::Slot> slots(catalog.size());
+                for (BookHandle i = 0; i < catalog.size(); i++) {
+                    slotStates.set(i, catalog[i].getState());
+                    slots[i] = {catalogLive[i]};
+                }
+                fresh.slots.assign(slots);
+                fresh.liveBooks = isbnIndex.size();
+            }
+            if (!publishedCatalog.load()) {
+                publishedCatalog.store(new CatalogVersion(move(fresh)));
+                return;
+            }
+
+            uint64_t retiredAt = publish([&](CatalogVersion& next) {
+                if (allSlots) {
+                    next.slots = fresh.slots;
+                    next.liveBooks = fresh.liveBooks;
+                }
+                next.base = fresh.base;
+                next.delta = fresh.delta;
+                next.removedSinceBase = 0;
+            });
+            if (!retiredBookSlots.empty()) {
+                pendingBookSlots.emplace_back(retiredAt, move(retiredBookSlots));
+                retiredBookSlots.clear();
+            }
+        }
+
+        // Make the quarantined slots no reader can see any more reusable;
+        // caller holds the exclusive lock
+        void releaseRetiredSlots() {
+            uint64_t oldest = ReaderEpochs::oldestPinned();
+            while (!pendingBookSlots.empty() && pendingBookSlots.front().first < oldest) {
+                for (BookHandle slot : pendingBookSlots.front().second) freeBookSlots.push_back(slot);
+                pendingBookSlots.pop_front();
+            }
+        }
+
+        // Index lookups without locking; callers hold catalogLock
+        BookHandle lookupBook(const string& isbn) const {
+            auto it = isbnIndex.find(isbn);
+            return it == isbnIndex.end() ? NO_HANDLE : it->second;
+        }
+
+        MemberHandle lookupMember(const string& memberId) const {
+            auto it = memberIndex.find(memberId);
+            return it == memberIndex.end() ? NO_HANDLE : it->second;
+        }
+
+        Availability stateOf(const Book& item) const {
+            lock_guard<mutex> lock(bookStripe(item.getISBN()));
+            return item.getState();
+        }
+
+        // Record a change to a book's line in book.csv
+        void bookChanged(BookHandle handle) {
+            if (loading) return;
+            catalog[handle].markDirty();
+            catalogChanged = true;
+        }
+
+        // Record a member added or removed; caller holds the exclusive lock
+        void memberSlotChanged(MemberHandle slot) {
+            if (loading) return;
+            if (memberSlotDirty.size() <= slot) memberSlotDirty.resize(slot + 1, false);
+            memberSlotDirty[slot] = true;
+            membersChanged = true;
+            circulationChanged = true;
+        }
+
+        // Timer maintenance; callers hold the member's stripe or the
+        // exclusive lock
+        static TimePoint dueDate(const Member* member, const BorrowInfo& loan) {
+            return loan.checkoutDate + ONE_DAY * member->getLoanPeriod();
+        }
+
+        static TimePoint nextAccrual(const Member* member, const BorrowInfo& loan) {
+            return dueDate(member, loan) + ONE_DAY * (loan.accruedDays + 1);
+        }
+
+        void scheduleLoan(MemberHandle memberHandle, BookHandle book, const BorrowInfo& loan) {
+            const Member* member = memberDatabase[memberHandle];
+            LoanTimers& timers = timersOf(member);
+            timers.due.insert({dueDate(member, loan), book, memberHandle});
+            if (member->getBlockAfterDays() > 0) {
+                timers.block.insert({loan.checkoutDate + ONE_DAY * (member->getBlockAfterDays() + 1), book, memberHandle});
+            }
+            if (member->calculateLateFee(1) > 0) {
+                timers.accrual.insert({nextAccrual(member, loan), book, memberHandle});
+            }
+        }
+
+        void unscheduleLoan(MemberHandle memberHandle, BookHandle book, const BorrowInfo& loan) {
+            Member* member = memberDatabase[memberHandle];
+            LoanTimers& timers = timersOf(member);
+            timers.due.erase({dueDate(member, loan), book, memberHandle});
+            timers.accrual.erase({nextAccrual(member, loan), book, memberHandle});
+            if (member->getBlockAfterDays() > 0 &&
+                !timers.block.erase({loan.checkoutDate + ONE_DAY * (member->getBlockAfterDays() + 1), book, memberHandle})) {
+                member->getMembership().addBlockingLoan(-1);  // its block timer had fired
+            }
+        }
+
+        // Count the loans in one shard that have started blocking their
+        // borrowers
+        void fireBlockTimers(LoanTimers& timers, TimePoint now) {
+            while (!timers.block.empty() && timers.block.begin()->when <= now) {
+                memberDatabase[timers.block.begin()->member]->getMembership().addBlockingLoan(1);
+                timers.block.erase(timers.block.begin());
+            }
+        }
+
+        void listBook(BookHandle handle) {
+            uint32_t book = static_cast<uint32_t>(handle);
+            booksByIsbn.insert(book);
+            booksByTitle.insert(book);
+            booksByYear.insert(book);
+        }
+
+        void unlistBook(BookHandle handle) {
+            uint32_t book = static_cast<uint32_t>(handle);
+            booksByIsbn.erase(book);
+            booksByTitle.erase(book);
+            booksByYear.erase(book);
+        }
+
+        void indexFilters(BookHandle handle) {
+            const Book& item = catalog[handle];
+            vector<BookHandle>& postings = booksByPublisher[item.getCompanyCode()];
+            postings.insert(lower_bound(postings.begin(), postings.end(), handle), handle);
+            for (SlotBitmap& bitmap : stateBitmaps) bitmap.reserve(catalog.size());
+            stateBitmaps[static_cast<int>(item.getState())].set(handle);
+        }
+
+        void unindexFilters(BookHandle handle) {
+            const Book& item = catalog[handle];
+            auto entry = booksByPublisher.find(item.getCompanyCode());
+            if (entry != booksByPublisher.end()) {
+                vector<BookHandle>& postings = entry->second;
+                auto pos = lower_bound(postings.begin(), postings.end(), handle);
+                if (pos != postings.end() && *pos == handle) postings.erase(pos);
+                if (postings.empty()) booksByPublisher.erase(entry);
+            }
+            stateBitmaps[static_cast<int>(item.getState())].clear(handle);
+        }
+
+        void buildFilterIndexes() {
+            for (SlotBitmap& bitmap : stateBitmaps) bitmap.reserve(catalog.size());
+            for (BookHandle i = 0; i < catalog.size(); i++) {
+                if (!catalogLive[i]) continue;
+                booksByPublisher[catalog[i].getCompanyCode()].push_back(i);
+                stateBitmaps[static_cast<int>(catalog[i].getState())].set(i);
+            }
+        }
+
+        // Move a book to another availability state and tell the filter
+        // bitmaps and the lock-free readers; caller holds its stripe or the
+        // exclusive lock
+        void changeState(BookHandle handle, Availability state) {
+            Book& item = catalog[handle];
+            if (!loading) {
+                stateBitmaps[static_cast<int>(item.getState())].clear(handle);
+                stateBitmaps[static_cast<int>(state)].set(handle);
+            }
+            item.setState(state);
+            publishState(handle);
+        }
+
+        // Sort the loaded records once rather than inserting them one by one
+        void buildListingIndexes() {
+            vector<uint32_t> handles;
+            for (BookHandle i = 0; i < catalog.size(); i++) {
+                if (catalogLive[i]) handles.push_back(static_cast<uint32_t>(i));
+            }
+            booksByIsbn.assign(handles);
+            booksByTitle.assign(handles);
+            booksByYear.assign(move(handles));
+
+            handles.clear();
+            for (MemberHandle i = 0; i < memberDatabase.size(); i++) {
+                if (memberDatabase[i]) handles.push_back(static_cast<uint32_t>(i));
+            }
+            membersById.assign(move(handles));
+        }
+
+        // Closed loans come from history.csv, open ones from the loaded
+        // loans; runs at startup before the journal replay
+        void loadHistory() {
+            history.load(dataPath("history.csv"), [this](const string& id) {
+                MemberHandle m = lookupMember(id);
+                return m == NO_HANDLE ? CirculationHistory::UNKNOWN_KIND : static_cast<uint8_t>(memberDatabase[m]->getKind());
+            });
+            for (MemberHandle m = 0; m < memberDatabase.size(); m++) {
+                const Member* member = memberDatabase[m];
+                if (!member) continue;
+                for (const BorrowInfo& loan : member->getMembership().getCheckedOutItems()) {
+                    history.recordCheckout(loan.isbn, member->getMemberCode(), member->getKind(), loan.checkoutDate);
+                }
+            }
+        }
+
+        // Time every loaded loan; runs at startup before the journal replay
+        void scheduleLoadedLoans() {
+            for (MemberHandle m = 0; m < memberDatabase.size(); m++) {
+                if (!memberDatabase[m]) continue;
+                for (const BorrowInfo& loan : memberDatabase[m]->getMembership().getCheckedOutItems()) {
+                    BookHandle book = lookupBook(loan.isbn);
+                    if (book != NO_HANDLE) scheduleLoan(m, book, loan);
+                }
+            }
+        }
+    
+    public:
+        // Constructor loads the snapshot, then replays the journal on top
+        explicit LibrarySystem(bool binarySnapshot = true, const string& directory = ".",
+                               const Clock& clockSource = Clock::system())
+            : useSnapshot(binarySnapshot), dataDir(directory), clock(clockSource) { 
+            loading = true;
+            bool fromSnapshot = importData(); 
+            loading = false;
+            buildListingIndexes();
+            buildFilterIndexes();
+            markLoadedFilesClean(fromSnapshot);
+            rebuildReservationSets();
+            scheduleLoadedLoans();
+            loadHistory();
+            replayJournal(fromSnapshot);
+            rebuildCatalogVersion(true);
+            if (!journal.open()) cerr << "Warning: could not open journal.log, changes will not be journaled.\n";
+            journalRecords = journal.size();
+            compactionDue = journalRecords >= JOURNAL_COMPACT_THRESHOLD;
+            journaling = true;
+            journalWriter.start();
+            compactor = thread(&LibrarySystem::runCompactor, this);
+        }
+        
+        // Destructor drains the journal queue to disk and cleans up. The
+        // journal is the durable record; the CSVs and snapshot catch up at
+        // the next compaction, or explicitly through compact() or exportData().
+        ~LibrarySystem() { 
+            {
+                lock_guard<mutex> lock(compactorLock);
+                stopCompactor = true;
+            }
+            compactorWake.notify_one();
+            compactor.join();
+            journalWriter.stop();
+            journal.close();
+            memberDatabase.clear();
+            delete publishedCatalog.load();
+            for (const auto& retired : retiredVersions) delete retired.second;
+        }
+
+        // Write a full snapshot and empty the journal it supersedes. The binary
+        // snapshot carries the new epoch, so a crash before the journal reset
+        // leaves an older-epoch journal that startup knows to skip.
+        void compact() {
+            ExclusiveLock lock(catalogLock);
+            compactLocked();
+        }
+
+        const LibraryMetrics& getMetrics() const { return metrics; }
+
+        // The current time on the library's clock
+        TimePoint now() const { return clock.now(); }
+
+        // Wait until every change so far is on disk, e.g. at logout
+        void syncJournal() { journalWriter.flush(); }
+
+        // When on, each mutation returns only once its journal record is on
+        // disk. Concurrent callers still share one fdatasync per batch.
+        void setSynchronousCommit(bool enabled) { synchronousCommit = enabled; }
+    
+        // Catalog management methods; rejects a duplicate ISBN
+        bool addbook(const Book& item) { 
+            CommitWhenDone commit{*this, 0};
+            ExclusiveLock lock(catalogLock);
+            if (isbnIndex.count(item.getISBN())) return false;
+
+            BookHandle slot;
+            releaseRetiredSlots();
+            if (!freeBookSlots.empty()) {
+                slot = freeBookSlots.back();
+                freeBookSlots.pop_back();
+                catalog[slot] = item;
+                catalogLive[slot] = true;
+            } else {
+                slot = catalog.size();
+                catalog.push_back(item);
+                catalogLive.push_back(true);
+            }
+            isbnIndex[item.getISBN()] = slot;
+            indexTokens(slot);
+            indexCompletions(slot);
+            if (!loading) {
+                listBook(slot);
+                indexFilters(slot);
+            }
+            publishAdded(slot);
+            bookChanged(slot);
+            commit.sequence = logChange("B," + item.serialize());
+            return true;
+        }
+        
+        void removebook(const string& isbn) {
+            CommitWhenDone commit{*this, 0};
+            ExclusiveLock lock(catalogLock);
+            auto it = isbnIndex.find(isbn);
+            if (it == isbnIndex.end()) return;
+
+            BookHandle slot = it->second;
+            isbnIndex.erase(it);
+            dropReservations(slot);
+            dropLoanTimers(slot);
+            unindexTokens(slot);
+            unindexCompletions(slot);
+            unlistBook(slot);
+            unindexFilters(slot);
+            catalogLive[slot] = false;
+            if (publishRemoved(slot)) retiredBookSlots.push_back(slot);
+            else freeBookSlots.push_back(slot);
+            bookChanged(slot);
+            commit.sequence = logChange("b," + isbn);
+        }
+    
+        // Bulk-load a vendor feed. Workers parse newline-aligned chunks in
+        // parallel; then one exclusive section skips ISBNs already in the
+        // catalog or earlier in the feed, appends the rest with the catalog
+        // grown once, updates the indexes concurrently and compacts, so the
+        // books reach the CSVs and snapshot without a journal record each.
+        // False if the feed cannot be opened.
+        bool ingestCatalog(const string& path, unsigned threadCount, IngestReport& report) {
+            OperationTimer timer(metrics, Operation::Import);
+            MappedFile feed;
+            if (!feed.open(path)) {
+                timer.finish(OpStatus::NotFound);
+                return false;
+            }
+            auto parseStart = chrono::steady_clock::now();
+
+            // Several chunks per thread, so one slow chunk does not leave the
+            // others idle, but none smaller than 64 KB
+            threadCount = max(1u, threadCount);
+            size_t chunkCount = max<size_t>(1, min<size_t>(threadCount * 4, feed.size() >> 16));
+            vector<FeedChunk> chunks;
+            for (const auto& slice : splitAtLines(feed.data(), feed.size(), chunkCount)) {
+                chunks.push_back(FeedChunk{slice.first, slice.second, chunks.empty(), 0, {}, {}});
+            }
+
+            atomic<size_t> nextChunk{0};
+            vector<thread> workers;
+            for (unsigned t = 0; t < min<size_t>(threadCount, chunks.size()); t++) {
+                workers.emplace_back([&] {
+                    unordered_map<string, uint32_t> creatorCodes, publisherCodes;
+                    for (size_t i = nextChunk++; i < chunks.size(); i = nextChunk++) {
+                        parseFeedChunk(chunks[i], creatorCodes, publisherCodes);
+                    }
+                });
+            }
+            for (thread& worker : workers) worker.join();
+
+            // Chunk-relative line numbers become feed line numbers
+            size_t linesBefore = 0, parsed = 0;
+            for (FeedChunk& chunk : chunks) {
+                for (FeedRow& row : chunk.books) row.line += linesBefore;
+                for (RejectedRow& row : chunk.rejected) row.line += linesBefore;
+                linesBefore += chunk.lines;
+                parsed += chunk.books.size();
+            }
+            auto mergeStart = chrono::steady_clock::now();
+            report.parseSeconds = chrono::duration<double>(mergeStart - parseStart).count();
+
+            {
+                ExclusiveLock lock(catalogLock);
+                BookHandle firstNew = catalog.size();
+                catalog.reserve(firstNew + parsed);
+                catalogLive.reserve(firstNew + parsed);
+                isbnIndex.reserve(isbnIndex.size() + parsed);
+                vector<uint32_t> added;
+                added.reserve(parsed);
+
+                for (FeedChunk& chunk : chunks) {
+                    report.rows += chunk.books.size() + chunk.rejected.size();
+                    for (RejectedRow& row : chunk.rejected) report.rejected.push_back(move(row));
+                    for (FeedRow& row : chunk.books) {
+                        auto existing = isbnIndex.find(row.book.getISBN());
+                        if (existing != isbnIndex.end()) {
+                            const char* reason = existing->second >= firstNew ? "duplicate_in_feed" : "duplicate_isbn";
+                            report.rejected.push_back(RejectedRow{row.line, reason, row.text.str()});
+                            continue;
+                        }
+                        BookHandle slot = catalog.size();
+                        isbnIndex.emplace(row.book.getISBN(), slot);
+                        catalog.push_back(move(row.book));
+                        catalogLive.push_back(true);
+                        bookChanged(slot);
+                        added.push_back(static_cast<uint32_t>(slot));
+                    }
+                    vector<FeedRow>().swap(chunk.books);
+                }
+
+                report.added = added.size();
+                if (!added.empty()) {
+                    // The search, completion and listing indexes do not share
+                    // state, so they are brought up to date side by side
+                    runConcurrently({
+                        [&] { for (uint32_t book : added) indexTokens(book); },
+                        [&] { for (uint32_t book : added) indexCompletions(book); },
+                        [&] { booksByIsbn.insertMany(added); },
+                        [&] { booksByTitle.insertMany(added); },
+                        [&] { booksByYear.insertMany(added); },
+                        [&] { for (uint32_t book : added) indexFilters(book); },
+                    }, threadCount);
+                    rebuildCatalogVersion(true);
+                    compactLocked();
+                }
+            }
+            stable_sort(report.rejected.begin(), report.rejected.end(),
+                        [](const RejectedRow& a, const RejectedRow& b) { return a.line < b.line; });
+            report.mergeSeconds = chrono::duration<double>(chrono::steady_clock::now() - mergeStart).count();
+            return true;
+        }
+    
+        // Member management methods; rejects a duplicate ID
+        bool registerMember(const string& id, const string& name, MemberKind kind) { 
+            CommitWhenDone commit{*this, 0};
+            ExclusiveLock lock(catalogLock);
+            if (memberIndex.count(id)) return false;
+
+            MemberHandle slot = memberDatabase.create(id, name, kind);
+            memberIndex[id] = slot;
+            if (!loading) membersById.insert(static_cast<uint32_t>(slot));
+            memberSlotChanged(slot);
+            commit.sequence = logChange("M," + memberDatabase[slot]->serialize());
+            return true;
+        }
+        
+        // The member must not be in use by another thread
+        void removeMember(const string& memberId) {
+            CommitWhenDone commit{*this, 0};
+            ExclusiveLock lock(catalogLock);
+            auto it = memberIndex.find(memberId);
+            if (it == memberIndex.end()) return;
+
+            MemberHandle slot = it->second;
+            memberIndex.erase(it);
+            membersById.erase(static_cast<uint32_t>(slot));
+            leaveQueues(memberDatabase[slot]);
+            for (const BorrowInfo& loan : memberDatabase[slot]->getMembership().getCheckedOutItems()) {
+                BookHandle book = lookupBook(loan.isbn);
+                if (book != NO_HANDLE) unscheduleLoan(slot, book, loan);
+            }
+            memberDatabase.destroy(slot);
+            memberSlotChanged(slot);
+            commit.sequence = logChange("m," + memberId);
+        }
+    
+        // Handle lookups: O(1) through the hash indexes
+        BookHandle findBookHandle(const string& isbn) const {
+            SharedLock lock(catalogLock);
+            return lookupBook(isbn);
+        }
+
+        MemberHandle findMemberHandle(const string& memberId) const {
+            SharedLock lock(catalogLock);
+            return lookupMember(memberId);
+        }
+
+        Book& bookAt(BookHandle handle) { return catalog[handle]; }
+        Member* memberAt(MemberHandle handle) { return memberDatabase[handle]; }
+
+        // Search methods; the returned pointer is only valid until the next
+        // catalog change, hold a BookHandle across mutations instead
+        Book* findbook(const string& isbn) {
+            SharedLock lock(catalogLock);
+            BookHandle handle = lookupBook(isbn);
+            return handle == NO_HANDLE ? nullptr : &catalog[handle];
+        }
+    
+        Member* findMember(const string& memberId) {
+            SharedLock lock(catalogLock);
+            MemberHandle handle = lookupMember(memberId);
+            return handle == NO_HANDLE ? nullptr : memberDatabase[handle];
+        }
+
+    private:
+        // Distinct tokens of a book's title and author
+        static vector<string> bookTokens(const Book& item) {
+            vector<string> tokens = tokenize(item.getName());
+            vector<string> authorTokens = tokenize(item.getCreator());
+            tokens.insert(tokens.end(), authorTokens.begin(), authorTokens.end());
+            sort(tokens.begin(), tokens.end());
+            tokens.erase(unique(tokens.begin(), tokens.end()), tokens.end());
+            return tokens;
+        }
+
+        void indexTokens(BookHandle handle) {
+            for (const string& token : bookTokens(catalog[handle])) {
+                vector<BookHandle>& postings = tokenIndex[token];
+                if (postings.empty()) fuzzyTokens.add(token);
+                postings.insert(lower_bound(postings.begin(), postings.end(), handle), handle);
+            }
+        }
+
+        void unindexTokens(BookHandle handle) {
+            for (const string& token : bookTokens(catalog[handle])) {
+                auto entry = tokenIndex.find(token);
+                if (entry == tokenIndex.end()) continue;
+                vector<BookHandle>& postings = entry->second;
+                auto pos = lower_bound(postings.begin(), postings.end(), handle);
+                if (pos != postings.end() && *pos == handle) postings.erase(pos);
+                if (postings.empty()) {
+                    fuzzyTokens.remove(token);
+                    tokenIndex.erase(entry);
+                }
+            }
+        }
+
+        // Distinct completion keys of a book: its ISBN, title and author
+        static vector<string> completionKeys(const Book& item) {
+            vector<string> keys = {completionKey(item.getISBN()), completionKey(item.getName()),
+                                   completionKey(item.getCreator())};
+            sort(keys.begin(), keys.end());
+            keys.erase(unique(keys.begin(), keys.end()), keys.end());
+            return keys;
+        }
+
+        void indexCompletions(BookHandle handle) {
+            for (const string& key : completionKeys(catalog[handle])) {
+                completions.insert(key, static_cast<uint32_t>(handle));
+            }
+        }
+
+        void unindexCompletions(BookHandle handle) {
+            for (const string& key : completionKeys(catalog[handle])) {
+                completions.erase(key, static_cast<uint32_t>(handle));
+            }
+        }
+
+    public:
+        // A point-in-time view of the catalog for searches and listings;
+        // taking it costs no lock and never waits for a writer
+        CatalogSnapshot snapshot() const { return CatalogSnapshot(publishedCatalog); }
+
+        // Up to `limit` books whose ISBN, title or author starts with the
+        // prefix, available books first, then borrowed, then reserved; ties
+        // keep key order. The walk stops once `limit` available books are
+        // found or after COMPLETION_SCAN_FACTOR * limit candidates.
+        vector<BookHandle> completePrefix(const string& prefix, size_t limit) const {
+            OperationTimer timer(metrics, Operation::Complete);
+            SharedLock lock(catalogLock);
+            string key = completionKey(prefix);
+            vector<pair<Availability, BookHandle>> candidates;
+            if (key.empty() || limit == 0) {
+                timer.finish(OpStatus::NotFound);
+                return {};
+            }
+
+            size_t available = 0;
+            completions.forEachWithPrefix(key, [&](uint32_t book) {
+                // A book can match on more than one of its keys
+                for (const auto& candidate : candidates) {
+                    if (candidate.second == book) return true;
+                }
+                Availability state = stateOf(catalog[book]);
+                candidates.push_back(make_pair(state, BookHandle(book)));
+                if (state == Availability::Available && ++available == limit) return false;
+                return candidates.size() < limit * COMPLETION_SCAN_FACTOR;
+            });
+
+            stable_sort(candidates.begin(), candidates.end(),
+                        [](const pair<Availability, BookHandle>& a, const pair<Availability, BookHandle>& b) {
+                            return a.first < b.first;
+                        });
+            vector<BookHandle> result;
+            for (size_t i = 0; i < candidates.size() && i < limit; i++) result.push_back(candidates[i].second);
+            if (result.empty()) timer.finish(OpStatus::NotFound);
+            return result;
+        }
+
+        // Books in which every query word matches a title or author word
+        // within allowedEdits of it, closest first (fewest edits summed over
+        // the words, then catalog order), at most `limit` of them
+        vector<FuzzyMatch> findFuzzyMatches(const string& query, size_t limit) const {
+            OperationTimer timer(metrics, Operation::Search);
+            SharedLock lock(catalogLock);
+            vector<string> words = tokenize(query);
+            vector<FuzzyMatch> result;
+            auto byBook = [](const FuzzyMatch& a, const FuzzyMatch& b) {
+                return a.book != b.book ? a.book < b.book : a.distance < b.distance;
+            };
+
+            for (size_t i = 0; i < words.size(); i++) {
+                // Books with some token close to this word, at their closest
+                vector<FuzzyMatch> matches;
+                for (const auto& token : fuzzyTokens.within(words[i], allowedEdits(words[i].size()))) {
+                    for (BookHandle book : tokenIndex.find(*token.first)->second) {
+                        matches.push_back(FuzzyMatch{book, token.second});
+                    }
+                }
+                sort(matches.begin(), matches.end(), byBook);
+                matches.erase(unique(matches.begin(), matches.end(),
+                                     [](const FuzzyMatch& a, const FuzzyMatch& b) { return a.book == b.book; }),
+                              matches.end());
+
+                if (i == 0) {
+                    result.swap(matches);
+                } else {
+                    vector<FuzzyMatch> both;
+                    for (size_t a = 0, b = 0; a < result.size() && b < matches.size();) {
+                        if (result[a].book < matches[b].book) a++;
+                        else if (matches[b].book < result[a].book) b++;
+                        else both.push_back(FuzzyMatch{result[a].book, result[a++].distance + matches[b++].distance});
+                    }
+                    result.swap(both);
+                }
+                if (result.empty()) break;
+            }
+
+            sort(result.begin(), result.end(), [](const FuzzyMatch& a, const FuzzyMatch& b) {
+                return a.distance != b.distance ? a.distance < b.distance : a.book < b.book;
+            });
+            if (result.size() > limit) result.resize(limit);
+            if (result.empty()) timer.finish(OpStatus::NotFound);
+            return result;
+        }
+
+        // Books matching every word of the query, by intersecting posting
+        // lists, in the given snapshot or the current one
+        vector<BookHandle> findMatches(const CatalogSnapshot& view, const string& query) const {
+            OperationTimer timer(metrics, Operation::Search);
+            vector<BookHandle> result = view.findMatches(query);
+            if (result.empty()) timer.finish(OpStatus::NotFound);
+            return result;
+        }
+
+        vector<BookHandle> findMatches(const string& query) const { return findMatches(snapshot(), query); }
+
+        // Books matching every field of the filter, in the given order, at
+        // most `limit` of them. Each predicate is a bitmap over the catalog
+        // slots: the union of the wanted availability bitmaps, the
+        // publisher's books from the publisher index, the books in the
+        // year range from the year listing. The bitmaps are intersected a
+        // word at a time, so only matching books are ever looked at.
+        vector<BookHandle> filterCatalog(const CatalogFilter& filter, CatalogOrder order, size_t limit) const {
+            OperationTimer timer(metrics, Operation::Search);
+            SharedLock structure(catalogLock);
+            size_t words = stateBitmaps[0].wordCount();
+            vector<uint64_t> matches(words, 0), predicate;
+            for (int state = 0; state < 3; state++) {
+                if (!filter.states.empty() &&
+                    find(filter.states.begin(), filter.states.end(), static_cast<Availability>(state)) == filter.states.end()) {
+                    continue;
+                }
+                for (size_t w = 0; w < words; w++) matches[w] |= stateBitmaps[state].word(w);
+            }
+            auto intersect = [&] {
+                for (size_t w = 0; w < words; w++) matches[w] &= predicate[w];
+            };
+
+            // A publisher's postings are usually far fewer than the books
+            // in a year range, so their years are checked in place
+            bool yearRange = filter.fromYear != INT32_MIN || filter.toYear != INT32_MAX;
+            if (!filter.publisher.empty()) {
+                predicate.assign(words, 0);
+                auto entry = booksByPublisher.find(Book::publishers.find(filter.publisher));
+                if (entry != booksByPublisher.end()) {
+                    for (BookHandle book : entry->second) {
+                        int32_t year = catalog[book].getPublicationYear();
+                        if (year >= filter.fromYear && year <= filter.toYear) predicate[book >> 6] |= uint64_t(1) << (book & 63);
+                    }
+                }
+                intersect();
+            } else if (yearRange) {
+                predicate.assign(words, 0);
+                auto position = booksByYear.seek([&](uint32_t book) { return catalog[book].getPublicationYear() < filter.fromYear; });
+                for (; !booksByYear.atEnd(position); booksByYear.advance(position)) {
+                    uint32_t book = booksByYear.at(position);
+                    if (catalog[book].getPublicationYear() > filter.toYear) break;
+                    predicate[book >> 6] |= uint64_t(1) << (book & 63);
+                }
+                intersect();
+            }
+
+            vector<BookHandle> result;
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t bits = matches[w]; bits; bits &= bits - 1) result.push_back(w * 64 + __builtin_ctzll(bits));
+            }
+            BookOrder less{&catalog, order};
+            if (result.size() > limit) {
+                partial_sort(result.begin(), result.begin() + limit, result.end(), less);
+                result.resize(limit);
+            } else {
+                sort(result.begin(), result.end(), less);
+            }
+            if (result.empty()) timer.finish(OpStatus::NotFound);
+            return result;
+        }
+    
+        // Checkout process. The silent core reports the outcome; checkoutbook
+        // prints it for the interactive menu.
+        OpStatus tryCheckout(Member* member, const string& isbn, bool* fulfilledReservation = nullptr) {
+            CommitWhenDone commit{*this, 0};
+            OperationTimer timer(metrics, Operation::Checkout);
+            SharedLock structure(catalogLock);
+            BookHandle handle = lookupBook(isbn);
+            if (handle == NO_HANDLE) return timer.finish(OpStatus::NotFound);
+
+            lock_guard<mutex> memberGuard(memberStripe(member->getMemberId()));
+            lock_guard<mutex> bookGuard(bookStripe(isbn));
+            Book* item = &catalog[handle];
+            uint32_t memberCode = member->getMemberCode();
+            if (item->getState() == Availability::Borrowed) return timer.finish(OpStatus::AlreadyBorrowed);
+            if (item->getState() == Availability::Reserved && item->getReserverCode() != memberCode) {
+                return timer.finish(OpStatus::ReservedByOther);
+            }
+            TimePoint checkoutDate = clock.now();
+            fireBlockTimers(timersOf(member), checkoutDate);
+            if (!member->isEligibleToBorrow()) return timer.finish(OpStatus::NotEligible);
+            
+            bool wasReservedByMember = (item->getState() == Availability::Reserved && 
+                                      item->getReserverCode() == memberCode);
+            
+            applyCheckout(member, handle, checkoutDate);
+            commit.sequence = logChange("C," + member->getMemberId() + "," + isbn + "," + 
+                      to_string(chrono::duration_cast<chrono::seconds>(checkoutDate.time_since_epoch()).count()));
+            
+            if (fulfilledReservation) *fulfilledReservation = wasReservedByMember;
+            return timer.finish(OpStatus::Ok);
+        }
+
+        void checkoutbook(Member* member, const string& isbn) {
+            bool wasReservedByMember = false;
+            OpStatus status = tryCheckout(member, isbn, &wasReservedByMember);
+            if (status != OpStatus::Ok) {
+                cout << statusMessage(status) << "\n";
+                return;
+            }
+            
+            cout << "Item checked out successfully.\n";
+            
+            if (wasReservedByMember) {
+                int remainingReserved = member->getMembership().getReservationCount();
+                cout << "Reservation fulfilled. You have " << remainingReserved 
+                     << " remaining reservations.\n";
+            }
+        }
+    
+        // Return process
+        OpStatus tryReturn(Member* member, const string& isbn, int* lateFee = nullptr) {
+            CommitWhenDone commit{*this, 0};
+            OperationTimer timer(metrics, Operation::Return);
+            SharedLock structure(catalogLock);
+            BookHandle handle = lookupBook(isbn);
+            if (handle == NO_HANDLE) return timer.finish(OpStatus::NotFound);
+
+            lock_guard<mutex> memberGuard(memberStripe(member->getMemberId()));
+            lock_guard<mutex> bookGuard(bookStripe(isbn));
+            Book* item = &catalog[handle];
+            if (item->getState() != Availability::Borrowed) return timer.finish(OpStatus::NotCheckedOut);
+            
+            BorrowInfo* loan = member->getMembership().findLoan(isbn);
+            if (!loan) return timer.finish(OpStatus::NotBorrowedByMember);
+            
+            // Late days the nightly accrual already charged are not charged again
+            TimePoint returnDate = clock.now();
+            int daysLate = max(0, daysBetween(loan->checkoutDate, returnDate) - member->getLoanPeriod());
+            int fee = max(0, member->calculateLateFee(daysLate) - member->calculateLateFee(loan->accruedDays));
+            
+            applyReturn(member, handle, fee, returnDate);
+            commit.sequence = logChange("R," + member->getMemberId() + "," + isbn + "," + to_string(fee) + "," +
+                      to_string(chrono::duration_cast<chrono::seconds>(returnDate.time_since_epoch()).count()));
+            
+            if (lateFee) *lateFee = fee;
+            return timer.finish(OpStatus::Ok);
+        }
+
+        void returnbook(Member* member, const string& isbn) {
+            int fee = 0;
+            OpStatus status = tryReturn(member, isbn, &fee);
+            if (status != OpStatus::Ok) {
+                cout << statusMessage(status) << "\n";
+                return;
+            }
+            
+            cout << "Item returned successfully.\n";
+            if (fee > 0) cout << "Late fee of " << fee << " rupees applied.\n";
+        }
+    
+        // Reservation process: a borrowed or held book can be reserved by any
+        // number of members, who are served first come, first served
+        OpStatus tryReserve(Member* member, const string& isbn) {
+            CommitWhenDone commit{*this, 0};
+            OperationTimer timer(metrics, Operation::Reserve);
+            SharedLock structure(catalogLock);
+            BookHandle handle = lookupBook(isbn);
+            if (handle == NO_HANDLE) return timer.finish(OpStatus::NotFound);
+
+            lock_guard<mutex> memberGuard(memberStripe(member->getMemberId()));
+            lock_guard<mutex> bookGuard(bookStripe(isbn));
+            Book* item = &catalog[handle];
+            if (item->getState() == Availability::Available) return timer.finish(OpStatus::NotReservable);
+            if (member->getMembership().hasReservation(isbn)) return timer.finish(OpStatus::AlreadyReserved);
+            
+            applyReserve(member, handle);
+            commit.sequence = logChange("V," + member->getMemberId() + "," + isbn);
+            return timer.finish(OpStatus::Ok);
+        }
+
+        void reservebook(Member* member, const string& isbn) {
+            OpStatus status = tryReserve(member, isbn);
+            if (status != OpStatus::Ok) {
+                cout << statusMessage(status) << "\n";
+                return;
+            }
+            cout << "Item reserved successfully.\n";
+        }
+
+        // Fee payment
+        void payFees(Member* member, double amount) {
+            CommitWhenDone commit{*this, 0};
+            SharedLock structure(catalogLock);
+            lock_guard<mutex> memberGuard(memberStripe(member->getMemberId()));
+            member->getMembership().clearFees(amount);
+            circulationChanged = true;
+            ostringstream record;
+            record << "P," << member->getMemberId() << "," << member->getMembership().getPendingFees();
+            commit.sequence = logChange(record.str());
+        }
+
+        // Nightly fee accrual: charges each late loan for the days it has been
+        // late so far. Only loans whose accrual timer crossed a day boundary
+        // are visited. Returns the number of loans charged.
+        size_t runFeeAccrual(TimePoint now) {
+            CommitWhenDone commit{*this, 0};
+            ExclusiveLock lock(catalogLock);
+            size_t charged = 0;
+            for (LoanTimers& timers : loanTimers) {
+                fireBlockTimers(timers, now);
+                while (!timers.accrual.empty() && timers.accrual.begin()->when <= now) {
+                    LoanTimer timer = *timers.accrual.begin();
+                    Member* member = memberDatabase[timer.member];
+                    const string& isbn = catalog[timer.book].getISBN();
+                    const BorrowInfo* loan = member->getMembership().findLoan(isbn);
+                    int daysLate = loan ? daysBetween(loan->checkoutDate, now) - member->getLoanPeriod() : 0;
+                    if (!loan || !applyAccrual(member, timer.book, daysLate)) {
+                        // A timer left behind by a loan that is gone or already charged
+                        timers.accrual.erase(timers.accrual.begin());
+                        continue;
+                    }
+                    commit.sequence = logChange("A," + member->getMemberId() + "," + isbn + "," + to_string(daysLate));
+                    charged++;
+                }
+            }
+            return charged;
+        }
+
+        // Loans past their due date, most overdue first. Walks only the
+        // expired front of each shard's due timers, not the members.
+        vector<OverdueLoan> getOverdueLoans(TimePoint now) const {
+            SharedLock structure(catalogLock);
+            vector<LoanTimer> expired;
+            for (size_t stripe = 0; stripe < LOCK_STRIPES; stripe++) {
+                lock_guard<mutex> memberGuard(memberStripes[stripe]);
+                const set<LoanTimer>& due = loanTimers[stripe].due;
+                for (auto it = due.begin(); it != due.end() && it->when < now; it++) expired.push_back(*it);
+            }
+            sort(expired.begin(), expired.end());
+            vector<OverdueLoan> overdue;
+            for (const LoanTimer& timer : expired) {
+                overdue.push_back({memberDatabase[timer.member]->getMemberId(), catalog[timer.book].getISBN(),
+                                   daysBetween(timer.when, now)});
+            }
+            return overdue;
+        }
+
+        // Circulation reports over the loan history; see CirculationHistory
+        vector<pair<string, size_t>> getMostBorrowed(TimePoint from, TimePoint to, size_t limit) {
+            return history.mostBorrowed(from, to, limit);
+        }
+        vector<CirculationHistory::LoanDuration> getAverageLoanDays() { return history.averageLoanDays(); }
+        vector<pair<string, double>> getRevenueByMonth() { return history.revenueByMonth(); }
+        size_t getHistorySize() { return history.size(); }
+
+        const vector<DanglingReference>& getDanglingReferences() const { return danglingReferences; }
+    
+    private:
+        // State changes shared by the live operations and journal replay
+        // A checkout by the first reserver fulfils their reservation and
+        // promotes the next member in the queue, who gets the book once it
+        // is returned
+        void applyCheckout(Member* member, BookHandle handle, chrono::system_clock::time_point checkoutDate) {
+            Book& item = catalog[handle];
+            member->getMembership().addCheckoutRecord({item.getISBN(), checkoutDate});
+            scheduleLoan(lookupMember(member->getMemberId()), handle, member->getMembership().getCheckedOutItems().back());
+            history.recordCheckout(item.getISBN(), member->getMemberCode(), member->getKind(), checkoutDate);
+            bookChanged(handle);
+            circulationChanged = true;
+            if (item.hasReservation() && item.getReserverCode() == member->getMemberCode()) {
+                member->getMembership().removeReservation(item.getISBN());
+                promoteNextReserver(handle);
+            }
+            changeState(handle, Availability::Borrowed);
+        }
+
+        void applyReturn(Member* member, BookHandle handle, int fee, chrono::system_clock::time_point returnDate) {
+            Book& item = catalog[handle];
+            const BorrowInfo* loan = member->getMembership().findLoan(item.getISBN());
+            if (loan) {
+                unscheduleLoan(lookupMember(member->getMemberId()), handle, *loan);
+                history.recordReturn(item.getISBN(), member->getMemberCode(), returnDate,
+                                     fee + member->calculateLateFee(loan->accruedDays));
+            }
+            member->getMembership().returnItem(item.getISBN(), fee);
+            changeState(handle, item.hasReservation() ? Availability::Reserved : Availability::Available);
+            bookChanged(handle);
+            circulationChanged = true;
+        }
+
+        // Charge a loan's late fee up to daysLate and move its accrual timer
+        // to the next day boundary; false if there was nothing to charge.
+        // Caller holds the exclusive lock.
+        bool applyAccrual(Member* member, BookHandle handle, int daysLate) {
+            BorrowInfo* loan = member->getMembership().findLoan(catalog[handle].getISBN());
+            if (!loan || daysLate <= loan->accruedDays) return false;
+            MemberHandle memberHandle = lookupMember(member->getMemberId());
+            set<LoanTimer>& accrual = timersOf(member).accrual;
+            accrual.erase({nextAccrual(member, *loan), handle, memberHandle});
+            int fee = member->calculateLateFee(daysLate) - member->calculateLateFee(loan->accruedDays);
+            member->getMembership().accrueLateDays(*loan, daysLate, fee);
+            accrual.insert({nextAccrual(member, *loan), handle, memberHandle});
+            circulationChanged = true;
+            return true;
+        }
+
+        // A removed book's loan stays on the member's record but is no longer
+        // timed; caller holds the exclusive lock
+        void dropLoanTimers(BookHandle handle) {
+            if (catalog[handle].getState() != Availability::Borrowed) return;
+            for (const LoanTimers& timers : loanTimers) {
+                for (const LoanTimer& timer : timers.due) {
+                    if (timer.book != handle) continue;
+                    const BorrowInfo* loan = memberDatabase[timer.member]->getMembership().findLoan(catalog[handle].getISBN());
+                    if (loan) unscheduleLoan(timer.member, handle, *loan);
+                    return;
+                }
+            }
+        }
+
+        void applyReserve(Member* member, BookHandle handle) {
+            Book& item = catalog[handle];
+            uint32_t memberCode = member->getMemberCode();
+            if (!item.hasReservation()) item.setReserverCode(memberCode);
+            else waitlists[stripeOf(item.getISBN())][handle].push_back(memberCode);
+            member->getMembership().addReservation(item.getISBN());
+            bookChanged(handle);
+        }
+
+        // Hand the book's reservation to the next queued member, if any.
+        // Caller holds the book's stripe or the exclusive lock.
+        void promoteNextReserver(BookHandle handle) {
+            Book& item = catalog[handle];
+            auto& shard = waitlists[stripeOf(item.getISBN())];
+            auto queue = shard.find(handle);
+            if (queue == shard.end()) {
+                item.clearReservation();
+                return;
+            }
+            item.setReserverCode(queue->second.front());
+            queue->second.pop_front();
+            if (queue->second.empty()) shard.erase(queue);
+        }
+
+        // Members queued for a book, first reserver first
+        vector<uint32_t> reservationQueue(BookHandle handle) const {
+            vector<uint32_t> queue;
+            const Book& item = catalog[handle];
+            if (!item.hasReservation()) return queue;
+            queue.push_back(item.getReserverCode());
+            const auto& shard = waitlists[stripeOf(item.getISBN())];
+            auto waiting = shard.find(handle);
+            if (waiting != shard.end()) queue.insert(queue.end(), waiting->second.begin(), waiting->second.end());
+            return queue;
+        }
+
+        // BookedBy column: the whole queue separated by ';'
+        string queueField(BookHandle handle) const {
+            string field;
+            for (uint32_t code : reservationQueue(handle)) {
+                if (!field.empty()) field += ';';
+                field += Book::memberIds.lookup(code);
+            }
+            return field;
+        }
+
+        string bookLine(BookHandle handle) const {
+            string line = catalog[handle].serialize();
+            const Book& item = catalog[handle];
+            if (!item.hasReservation()) return line;
+            return line.substr(0, line.size() - item.getBookedBy().size()) + queueField(handle);
+        }
+
+        // Queue the members after the first reserver of a loaded BookedBy field
+        void restoreWaitlist(const string& isbn, const FieldView& queueField) {
+            BookHandle handle = lookupBook(isbn);
+            const char* p = static_cast<const char*>(memchr(queueField.data, ';', queueField.size));
+            if (handle == NO_HANDLE || !p) return;
+            const char* end = queueField.data + queueField.size;
+            auto& queue = waitlists[stripeOf(isbn)][handle];
+            while (p < end) {
+                const char* start = p + 1;
+                p = static_cast<const char*>(memchr(start, ';', end - start));
+                if (!p) p = end;
+                if (p > start) queue.push_back(Book::memberIds.intern(string(start, p)));
+            }
+            if (queue.empty()) waitlists[stripeOf(isbn)].erase(handle);
+        }
+
+        // Startup: derive each member's reservation set from the book queues
+        void rebuildReservationSets() {
+            for (BookHandle i = 0; i < catalog.size(); i++) {
+                if (!catalogLive[i]) continue;
+                for (uint32_t code : reservationQueue(i)) {
+                    MemberHandle member = lookupMember(Book::memberIds.lookup(code));
+                    if (member != NO_HANDLE) memberDatabase[member]->getMembership().addReservation(catalog[i].getISBN());
+                }
+            }
+        }
+
+        // Removing a book cancels every reservation on it; caller holds the
+        // exclusive lock
+        void dropReservations(BookHandle handle) {
+            const string& isbn = catalog[handle].getISBN();
+            for (uint32_t code : reservationQueue(handle)) {
+                MemberHandle member = lookupMember(Book::memberIds.lookup(code));
+                if (member != NO_HANDLE) memberDatabase[member]->getMembership().removeReservation(isbn);
+            }
+            waitlists[stripeOf(isbn)].erase(handle);
+            catalog[handle].clearReservation();
+        }
+
+        // Removing a member takes them out of every queue they are in; caller
+        // holds the exclusive lock
+        void leaveQueues(Member* member) {
+            uint32_t memberCode = member->getMemberCode();
+            for (const string& isbn : member->getMembership().getReservedItems()) {
+                BookHandle handle = lookupBook(isbn);
+                if (handle == NO_HANDLE) continue;
+                bookChanged(handle);
+                Book& item = catalog[handle];
+                if (item.getReserverCode() == memberCode) {
+                    promoteNextReserver(handle);
+                    if (item.getState() == Availability::Reserved && !item.hasReservation()) {
+                        changeState(handle, Availability::Available);
+                    }
+                    continue;
+                }
+                auto& shard = waitlists[stripeOf(isbn)];
+                auto queue = shard.find(handle);
+                if (queue == shard.end()) continue;
+                queue->second.erase(remove(queue->second.begin(), queue->second.end(), memberCode), queue->second.end());
+                if (queue->second.empty()) shard.erase(queue);
+            }
+        }
+
+        // Re-apply journaled changes on top of the loaded snapshot. Records
+        // from an epoch the binary snapshot already covers are skipped, and
+        // so are malformed ones, with a warning, as the CSV loader does.
+        void replayJournal(bool fromSnapshot) {
+            vector<string> records = journal.load(dataPath("journal.log"));
+            if (fromSnapshot && journal.getEpoch() < snapshotEpoch) {
+                journal.reset(snapshotEpoch);
+                return;
+            }
+            snapshotEpoch = max(snapshotEpoch, journal.getEpoch());
+            const size_t SHOWN = 5;
+            size_t malformed = 0;
+            for (size_t i = 0; i < records.size(); i++) {
+                try {
+                    replayRecord(records[i]);
+                } catch (const exception&) {
+                    if (malformed++ < SHOWN) cerr << "Warning: journal.log record " << i + 1 << " is malformed, skipped.\n";
+                }
+            }
+            if (malformed > SHOWN) cerr << "Warning: " << malformed - SHOWN << " more malformed journal record(s) skipped.\n";
+        }
+
+        // Apply one journal record; throws on a malformed number
+        void replayRecord(const string& record) {
+            istringstream stream(record);
+            string op, mid, isbn, value;
+            getline(stream, op, ',');
+
+            if (op == "B") {
+                getline(stream, value);
+                addbook(Book::deserialize(value));
+            } else if (op == "b") {
+                getline(stream, isbn);
+                removebook(isbn);
+            } else if (op == "M") {
+                string name, type;
+                getline(stream, mid, ',');
+                getline(stream, name, ',');
+                getline(stream, type);
+                MemberKind kind;
+                if (parseMemberKind(type, kind)) registerMember(mid, name, kind);
+            } else if (op == "m") {
+                getline(stream, mid);
+                removeMember(mid);
+            } else {
+                getline(stream, mid, ',');
+                Member* member = findMember(mid);
+                if (!member) return;
+
+                if (op == "P") {
+                    getline(stream, value);
+                    member->getMembership().setPendingFees(stod(value));
+                    circulationChanged = true;
+                    return;
+                }
+
+                getline(stream, isbn, ',');
+                getline(stream, value);
+                BookHandle handle = findBookHandle(isbn);
+                if (handle == NO_HANDLE) return;
+
+                if (op == "C") {
+                    applyCheckout(member, handle, chrono::system_clock::time_point(chrono::seconds(stoll(value))));
+                } else if (op == "R") {
+                    // Records written before the return time was logged replay as returned now
+                    size_t comma = value.find(',');
+                    auto returnDate = comma == string::npos ? clock.now()
+                        : chrono::system_clock::time_point(chrono::seconds(stoll(value.substr(comma + 1))));
+                    applyReturn(member, handle, stoi(value), returnDate);
+                } else if (op == "A") {
+                    applyAccrual(member, handle, stoi(value));
+                } else if (op == "V" && !member->getMembership().hasReservation(isbn)) {
+                    applyReserve(member, handle);
+                }
+            }
+        }
+
+    public:
+        // Count reservations for a member, O(1) from their reservation set
+        int getReservationCount(const string& memberId) const {
+            SharedLock structure(catalogLock);
+            MemberHandle handle = lookupMember(memberId);
+            if (handle == NO_HANDLE) return 0;
+            lock_guard<mutex> memberGuard(memberStripe(memberId));
+            return memberDatabase[handle]->getMembership().getReservationCount();
+        }
+    
+        // Search functions: case-insensitive, each query word matches the
+        // start of a title or author word. With no word match, falls back to
+        // completing the query as the start of an ISBN, title or author, and
+        // then to a fuzzy search that tolerates misspellings.
+        // The word search reads a snapshot without locking; the fallbacks
+        // use the locked indexes and print from a snapshot taken after them.
+        void searchCatalog(const string& query) {
+            CatalogSnapshot view = snapshot();
+            vector<BookHandle> matches = findMatches(view, query);
+            if (!matches.empty()) return printMatches(view, matches);
+
+            matches = completePrefix(query, 10);
+            if (matches.empty()) {
+                for (const FuzzyMatch& match : findFuzzyMatches(query, 10)) matches.push_back(match.book);
+            }
+            printMatches(snapshot(), matches);
+        }
+
+        void printMatches(const CatalogSnapshot& view, const vector<BookHandle>& matches) const {
+            if (view.liveBooks() == 0) { 
+                cout << "Catalog is empty.\n"; 
+                return; 
+            }
+            
+            for (BookHandle handle : matches) {
+                if (!view.contains(handle)) continue;
+                const Book& item = view.book(handle);
+                cout << item.getISBN() << " - " << item.getName() << " by " 
+                     << item.getCreator() << " (" << availabilityName(view.state(handle)) << ")\n";
+            }
+            
+            if (matches.empty()) cout << "No matching items found.\n";
+        }
+    
+        // Listing pages: keyset pagination over the sorted indexes. Each call
+        // writes up to pageSize rows after the cursor, moves the cursor to
+        // the last row written and returns the number written, 0 at the end.
+        // A page costs a binary search plus the page, whatever its depth,
+        // and reads a snapshot without locking.
+        size_t writeCatalogPage(BufferedWriter& out, CatalogOrder order, ListingCursor& cursor, size_t pageSize) const {
+            return snapshot().writeCatalogPage(out, order, cursor, pageSize);
+        }
+
+        // Member directory pages in member ID order; only the cursor's id is used
+        size_t writeMemberPage(BufferedWriter& out, ListingCursor& cursor, size_t pageSize) const {
+            SharedLock structure(catalogLock);
+            SortedIndex<MemberOrder>::Position position = membersById.begin();
+            if (cursor.started) {
+                position = membersById.seek([&](uint32_t member) {
+                    return memberDatabase[member]->getMemberId() <= cursor.id;
+                });
+            }
+
+            size_t written = 0;
+            for (; written < pageSize && !membersById.atEnd(position); membersById.advance(position), written++) {
+                const Member* member = memberDatabase[membersById.at(position)];
+                out << member->getMemberId() << " - " << member->getFullName()
+                    << " (" << member->getMemberType() << ")\n";
+                cursor.id = member->getMemberId();
+                cursor.started = true;
+            }
+            return written;
+        }
+    
+        // Data persistence methods; true if the binary snapshot was used
+        bool importData() {
+            OperationTimer timer(metrics, Operation::Import);
+            if (useSnapshot && snapshotIsCurrent() && importSnapshot()) return true;
+
+            // The files are independent, so they are parsed side by side, and
+            // the catalog, usually the largest, in several slices
+            const char* catalogName = dataFileName("book.csv", "books.csv");
+            const char* memberName = dataFileName("members.csv", "users.csv");
+            const char* loanName = dataFileName("checkouts.csv", "borrowings.csv");
+            const char* feeName = dataFileName("fees.csv", "fines.csv");
+            MappedFile catalogFile, memberFile, loanFile, feeFile;
+            bool haveCatalog = catalogFile.open(dataPath(catalogName));
+            bool haveMembers = memberFile.open(dataPath(memberName));
+            loanFile.open(dataPath(loanName));
+            feeFile.open(dataPath(feeName));
+
+            unsigned threadCount = max(1u, thread::hardware_concurrency());
+            vector<CatalogSlice> slices;
+            for (const auto& slice : splitAtLines(catalogFile.data(), catalogFile.size(), threadCount * 4)) {
+                slices.push_back(CatalogSlice{slice.first, slice.second, {}, {}});
+            }
+            vector<MemberRow> memberRows;
+            vector<LoanRow> loanRows;
+            vector<FeeRow> feeRows;
+            vector<function<void()>> parsers = {
+                [&] { memberRows = parseMemberRows(memberFile); },
+                [&] { loanRows = parseLoanRows(loanFile); },
+                [&] { feeRows = parseFeeRows(feeFile); },
+            };
+            for (CatalogSlice& slice : slices) parsers.push_back([&slice] { parseCatalogSlice(slice); });
+            runConcurrently(parsers, threadCount);
+
+            // Books and members share no state, so they go in side by side
+            vector<uint32_t> loadedBooks;
+            runConcurrently({
+                [&] {
+                    if (haveCatalog) loadedBooks = insertLoadedBooks(slices);
+                    else addDefaultBooks();
+                },
+                [&] {
+                    if (haveMembers) insertLoadedMembers(memberRows);
+                    else addDefaultMembers();
+                },
+            }, threadCount);
+
+            // Loans and fees resolve through the ISBN and member indexes
+            // while the search indexes are built
+            runConcurrently({
+                [&] { for (uint32_t book : loadedBooks) indexTokens(book); },
+                [&] { for (uint32_t book : loadedBooks) indexCompletions(book); },
+                [&] { resolveLoansAndFees(loanName, loanRows, feeName, feeRows); },
+            }, threadCount);
+            reportDanglingReferences();
+            return false;
+        }
+
+        const char* dataFileName(const char* exported, const char* shipped) const {
+            return ::dataFileName(dataDir, exported, shipped);
+        }
+
+        // Append the parsed books in file order, skipping repeated ISBNs, and
+        // restore their waitlists. Returns the new handles, not yet indexed
+        // for search.
+        vector<uint32_t> insertLoadedBooks(vector<CatalogSlice>& slices) {
+            size_t total = 0;
+            for (const CatalogSlice& slice : slices) total += slice.books.size();
+            catalog.reserve(catalog.size() + total);
+            catalogLive.reserve(catalogLive.size() + total);
+            isbnIndex.reserve(isbnIndex.size() + total);
+            vector<uint32_t> added;
+            added.reserve(total);
+            for (CatalogSlice& slice : slices) {
+                for (size_t i = 0; i < slice.books.size(); i++) {
+                    if (isbnIndex.count(slice.books[i].getISBN())) continue;
+                    BookHandle slot = catalog.size();
+                    isbnIndex.emplace(slice.books[i].getISBN(), slot);
+                    catalog.push_back(move(slice.books[i]));
+                    catalogLive.push_back(true);
+                    restoreWaitlist(catalog[slot].getISBN(), slice.waitlists[i]);
+                    added.push_back(static_cast<uint32_t>(slot));
+                }
+                vector<Book>().swap(slice.books);
+            }
+            return added;
+        }
+
+        void insertLoadedMembers(const vector<MemberRow>& rows) {
+            memberIndex.reserve(memberIndex.size() + rows.size());
+            for (const MemberRow& row : rows) {
+                string id = row.id.str();
+                if (memberIndex.count(id)) continue;
+                MemberHandle slot = memberDatabase.create(id, row.name.str(), row.kind);
+                memberIndex.emplace(move(id), slot);
+            }
+        }
+
+        // One hash lookup per reference. A loan of a book that is not in
+        // the catalog stays on the member's record, as after removebook,
+        // but is reported; rows of unknown members are dropped.
+        void resolveLoansAndFees(const char* loanName, const vector<LoanRow>& loans,
+                                 const char* feeName, const vector<FeeRow>& fees) {
+            for (const LoanRow& row : loans) {
+                auto member = memberIndex.find(row.member.str());
+                if (member == memberIndex.end()) {
+                    danglingReferences.push_back(DanglingReference{loanName, row.line, "member", row.member.str()});
+                    continue;
+                }
+                string isbn = row.isbn.str();
+                if (!isbnIndex.count(isbn)) danglingReferences.push_back(DanglingReference{loanName, row.line, "isbn", isbn});
+                memberDatabase[member->second]->getMembership().addCheckoutRecord(
+                    {move(isbn), TimePoint(chrono::seconds(row.checkoutDate)), static_cast<int>(row.accruedDays)});
+            }
+            for (const FeeRow& row : fees) {
+                auto member = memberIndex.find(row.member.str());
+                if (member == memberIndex.end()) {
+                    danglingReferences.push_back(DanglingReference{feeName, row.line, "member", row.member.str()});
+                    continue;
+                }
+                memberDatabase[member->second]->getMembership().setPendingFees(row.fee);
+            }
+        }
+
+        void reportDanglingReferences() const {
+            const size_t SHOWN = 5;
+            for (size_t i = 0; i < danglingReferences.size() && i < SHOWN; i++) {
+                const DanglingReference& ref = danglingReferences[i];
+                cerr << "Warning: " << ref.file << " line " << ref.line << " refers to unknown " << ref.field << " "
+                     << ref.value << ".\n";
+            }
+            if (danglingReferences.size() > SHOWN) {
+                cerr << "Warning: " << danglingReferences.size() - SHOWN << " more unknown reference(s).\n";
+            }
+        }
+
+        void addDefaultBooks() {
+            addbook(Book("LIT001", "Advanced Programming", 2022, "Jane Doe", "TechPress"));
+            addbook(Book("LIT002", "Data Structures", 2020, "John Smith", "CodeBooks"));
+            addbook(Book("LIT003", "Algorithm Design", 2021, "Alice Johnson", "CompSci"));
+            addbook(Book("LIT004", "Database Systems", 2019, "Bob Williams", "DataPub"));
+            addbook(Book("LIT005", "Machine Learning", 2023, "Carol Brown", "AIPress"));
+        }
+
+        void addDefaultMembers() {
+            registerMember("STU1", "Student One", MemberKind::Student);
+            registerMember("STU2", "Student Two", MemberKind::Student);
+            registerMember("STU3", "Student Three", MemberKind::Student);
+            registerMember("STU4", "Student Four", MemberKind::Student);
+            registerMember("STU5", "Student Five", MemberKind::Student);
+            registerMember("PROF1", "Professor One", MemberKind::Faculty);
+            registerMember("PROF2", "Professor Two", MemberKind::Faculty);
+            registerMember("PROF3", "Professor Three", MemberKind::Faculty);
+            registerMember("STAFF1", "Staff One", MemberKind::Librarian);
+        }
+
+        // The snapshot is used only if no CSV file was edited after it
+        bool snapshotIsCurrent() const {
+            time_t snapshotTime = fileModifiedTime(dataPath("library.snap"));
+            if (snapshotTime == 0) return false;
+            for (const char* csv : {"book.csv", "members.csv", "checkouts.csv", "fees.csv",
+                                    "books.csv", "users.csv", "borrowings.csv", "fines.csv"}) {
+                if (fileModifiedTime(dataPath(csv)) > snapshotTime) return false;
+            }
+            return true;
+        }
+
+        // Load library.snap with bulk section reads; false leaves the library
+        // empty so the caller can fall back to the CSV files
+        bool importSnapshot() {
+            MappedFile file;
+            if (!file.open(dataPath("library.snap"))) return false;
+            const char* data = file.data();
+            size_t size = file.size();
+
+            uint32_t version, sectionCount;
+            uint64_t epoch;
+            size_t headerSize = sizeof(SNAPSHOT_MAGIC) + sizeof(version) + sizeof(sectionCount) + sizeof(epoch);
+            if (size < headerSize || memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) return false;
+            memcpy(&version, data + 8, sizeof(version));
+            memcpy(&sectionCount, data + 12, sizeof(sectionCount));
+            memcpy(&epoch, data + 16, sizeof(epoch));
+            if (version != SNAPSHOT_VERSION && version != 1) {
+                cerr << "Warning: library.snap has unsupported version " << version << ", loading CSV files.\n";
+                return false;
+            }
+
+            vector<FieldView> pool;
+            vector<SnapshotBook> books;
+            vector<SnapshotMember> members;
+            vector<SnapshotLoan> loans;
+            vector<SnapshotFee> fees;
+            size_t offset = headerSize;
+            for (uint32_t i = 0; i < sectionCount; i++) {
+                uint32_t tag;
+                uint64_t bytes;
+                if (size - offset < sizeof(tag) + sizeof(bytes)) return false;
+                memcpy(&tag, data + offset, sizeof(tag));
+                memcpy(&bytes, data + offset + sizeof(tag), sizeof(bytes));
+                offset += sizeof(tag) + sizeof(bytes);
+                if (size - offset < bytes) return false;
+                const char* payload = data + offset;
+                offset += bytes;
+
+                bool ok = true;
+                switch (tag) {
+                    case SECTION_STRINGS: {
+                        vector<uint32_t> lengths;
+                        uint32_t count;
+                        if (bytes < sizeof(count)) return false;
+                        memcpy(&count, payload, sizeof(count));
+                        uint64_t tableBytes = sizeof(count) + static_cast<uint64_t>(count) * sizeof(uint32_t);
+                        if (bytes < tableBytes) return false;
+                        lengths.resize(count);
+                        if (count) memcpy(lengths.data(), payload + sizeof(count), count * sizeof(uint32_t));
+
+                        const char* text = payload + tableBytes;
+                        uint64_t remaining = bytes - tableBytes;
+                        pool.reserve(count);
+                        for (uint32_t length : lengths) {
+                            if (length > remaining) return false;
+                            pool.push_back({text, length});
+                            text += length;
+                            remaining -= length;
+                        }
+                        break;
+                    }
+                    case SECTION_BOOKS: ok = readSection(payload, bytes, books); break;
+                    case SECTION_MEMBERS: ok = readSection(payload, bytes, members); break;
+                    case SECTION_LOANS:
+                        if (version == 1) {
+                            vector<SnapshotLoanV1> oldLoans;
+                            ok = readSection(payload, bytes, oldLoans);
+                            for (const SnapshotLoanV1& l : oldLoans) loans.push_back({l.member, l.isbn, l.checkoutDate, 0});
+                        } else {
+                            ok = readSection(payload, bytes, loans);
+                        }
+                        break;
+                    case SECTION_FEES: ok = readSection(payload, bytes, fees); break;
+                    default: break;  // Sections from newer minor revisions are skipped
+                }
+                if (!ok) return false;
+            }
+
+            // Validate every string reference before touching the library
+            auto valid = [&pool](uint32_t id) { return id < pool.size(); };
+            for (const SnapshotBook& b : books) {
+                if (!valid(b.isbn) || !valid(b.name) || !valid(b.creator) || !valid(b.company) ||
+                    !valid(b.availability) || !valid(b.bookedBy)) return false;
+            }
+            for (const SnapshotMember& m : members) {
+                if (!valid(m.id) || !valid(m.name) || !valid(m.type)) return false;
+            }
+            for (const SnapshotLoan& l : loans) {
+                if (!valid(l.member) || !valid(l.isbn)) return false;
+            }
+            for (const SnapshotFee& f : fees) {
+                if (!valid(f.member)) return false;
+            }
+
+            catalog.reserve(books.size());
+            catalogLive.reserve(books.size());
+            isbnIndex.reserve(books.size());
+            for (const SnapshotBook& b : books) {
+                Book item(pool[b.isbn].str(), pool[b.name].str(), b.year, pool[b.creator].str(), pool[b.company].str());
+                item.setAvailability(pool[b.availability].str());
+                const FieldView& queue = pool[b.bookedBy];
+                const char* separator = static_cast<const char*>(memchr(queue.data, ';', queue.size));
+                item.setBookedBy(separator ? string(queue.data, separator) : queue.str());
+                if (addbook(item)) restoreWaitlist(item.getISBN(), queue);
+            }
+
+            memberDatabase.reserve(members.size());
+            memberIndex.reserve(members.size());
+            MemberKind kind;
+            for (const SnapshotMember& m : members) {
+                if (parseMemberKind(pool[m.type].str(), kind)) registerMember(pool[m.id].str(), pool[m.name].str(), kind);
+            }
+            for (const SnapshotLoan& l : loans) {
+                Member* m = findMember(pool[l.member].str());
+                if (m) m->getMembership().addCheckoutRecord({pool[l.isbn].str(),
+                        chrono::system_clock::time_point(chrono::seconds(l.checkoutDate)), static_cast<int>(l.accruedDays)});
+            }
+            for (const SnapshotFee& f : fees) {
+                Member* m = findMember(pool[f.member].str());
+                if (m) m->getMembership().setPendingFees(f.fee);
+            }
+
+            snapshotEpoch = epoch;
+            return true;
+        }
+
+        // Write library.snap: string-pooled, length-prefixed sections
+        void exportSnapshot() {
+            StringPool pool;
+            vector<SnapshotBook> books;
+            vector<SnapshotMember> members;
+            vector<SnapshotLoan> loans;
+            vector<SnapshotFee> fees;
+
+            books.reserve(isbnIndex.size());
+            for (BookHandle i = 0; i < catalog.size(); i++) {
+                if (!catalogLive[i]) continue;
+                const Book& b = catalog[i];
+                books.push_back({pool.intern(b.getISBN()), pool.intern(b.getName()), pool.intern(b.getCreator()),
+                                 pool.intern(b.getCompany()), pool.intern(b.getAvailability()),
+                                 pool.intern(queueField(i)), b.getPublicationYear()});
+            }
+
+            members.reserve(memberIndex.size());
+            for (MemberHandle i = 0; i < memberDatabase.size(); i++) {
+                const Member* member = memberDatabase[i];
+                if (!member) continue;
+                uint32_t id = pool.intern(member->getMemberId());
+                members.push_back({id, pool.intern(member->getFullName()), pool.intern(member->getMemberType())});
+                for (const auto& info : member->getMembership().getCheckedOutItems()) {
+                    loans.push_back({id, pool.intern(info.isbn), static_cast<int64_t>(
+                        chrono::duration_cast<chrono::seconds>(info.checkoutDate.time_since_epoch()).count()),
+                        info.accruedDays});
+                }
+                double fee = member->getMembership().getPendingFees();
+                if (fee > 0) {
+                    SnapshotFee record;
+                    memset(&record, 0, sizeof(record));  // padding is written to disk too
+                    record.member = id;
+                    record.fee = fee;
+                    fees.push_back(record);
+                }
+            }
+
+            string out(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+            uint32_t version = SNAPSHOT_VERSION, sectionCount = 5;
+            uint64_t epoch = snapshotEpoch;
+            out.append(reinterpret_cast<const char*>(&version), sizeof(version));
+            out.append(reinterpret_cast<const char*>(&sectionCount), sizeof(sectionCount));
+            out.append(reinterpret_cast<const char*>(&epoch), sizeof(epoch));
+
+            string strings = pool.serialize();
+            uint32_t tag = SECTION_STRINGS;
+            uint64_t bytes = strings.size();
+            out.append(reinterpret_cast<const char*>(&tag), sizeof(tag));
+            out.append(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+            out += strings;
+            appendSection(out, SECTION_BOOKS, books);
+            appendSection(out, SECTION_MEMBERS, members);
+            appendSection(out, SECTION_LOANS, loans);
+            appendSection(out, SECTION_FEES, fees);
+
+            if (!writeFileAtomically(dataPath("library.snap"), out)) cerr << "Warning: could not write library.snap.\n";
+        }
+    
+        // Export data to files
+        void exportData() {
+            ExclusiveLock lock(catalogLock);
+            exportFiles();
+        }
+
+    private:
+        // Caller holds catalogLock exclusively. Only files with changes are
+        // written, each to a temporary file renamed over the old one.
+        void exportFiles() {
+            OperationTimer timer(metrics, Operation::Export);
+            bool wrote = false;
+
+            if (catalogChanged) {
+                vector<bool> dirty = dirtySegments(catalog.size(), [this](size_t i) { return catalog[i].isDirty(); });
+                bool ok = rewriteSegments(dataPath("book.csv"), dirty.size(), dirty, bookSegments,
+                    [this](size_t segment, BufferedWriter& out) {
+                        for (BookHandle i = segmentStart(segment); i < segmentEnd(segment, catalog.size()); i++) {
+                            if (catalogLive[i]) out << bookLine(i) << '\n';
+                        }
+                    });
+                if (ok) {
+                    forEachDirtyRecord(dirty, catalog.size(), [this](size_t i) { catalog[i].clearDirty(); });
+                    catalogChanged = false;
+                } else {
+                    cerr << "Warning: could not write book.csv.\n";
+                }
+                wrote = true;
+            }
+
+            size_t slots = memberDatabase.size();
+            memberSlotDirty.resize(slots, false);
+            bool membersOk = true, circulationOk = true;
+            if (membersChanged) {
+                vector<bool> dirty = dirtySegments(slots, [this](size_t i) { return memberSlotDirty[i]; });
+                membersOk = rewriteSegments(dataPath("members.csv"), dirty.size(), dirty, memberSegments,
+                    [this, slots](size_t segment, BufferedWriter& out) {
+                        for (MemberHandle i = segmentStart(segment); i < segmentEnd(segment, slots); i++) {
+                            if (memberDatabase[i]) out << memberDatabase[i]->serialize() << '\n';
+                        }
+                    });
+                if (membersOk) membersChanged = false;
+                else cerr << "Warning: could not write members.csv.\n";
+                wrote = true;
+            }
+
+            if (circulationChanged) {
+                vector<bool> dirty = dirtySegments(slots, [this](size_t i) {
+                    return memberSlotDirty[i] || (memberDatabase[i] && memberDatabase[i]->getMembership().isDirty());
+                });
+                // Checkout data
+                circulationOk = rewriteSegments(dataPath("checkouts.csv"), dirty.size(), dirty, loanSegments,
+                    [this, slots](size_t segment, BufferedWriter& out) {
+                        for (MemberHandle i = segmentStart(segment); i < segmentEnd(segment, slots); i++) {
+                            const Member* member = memberDatabase[i];
+                            if (!member) continue;
+                            for (const auto& info : member->getMembership().getCheckedOutItems()) {
+                                long long timeStamp = chrono::duration_cast<chrono::seconds>
+                                                    (info.checkoutDate.time_since_epoch()).count();
+                                out << member->getMemberId() << ',' << info.isbn << ',' << timeStamp;
+                                if (info.accruedDays > 0) out << ',' << info.accruedDays;
+                                out << '\n';
+                            }
+                        }
+                    });
+                if (!circulationOk) cerr << "Warning: could not write checkouts.csv.\n";
+
+                // Fees data
+                bool feesOk = rewriteSegments(dataPath("fees.csv"), dirty.size(), dirty, feeSegments,
+                    [this, slots](size_t segment, BufferedWriter& out) {
+                        for (MemberHandle i = segmentStart(segment); i < segmentEnd(segment, slots); i++) {
+                            const Member* member = memberDatabase[i];
+                            if (!member) continue;
+                            double fee = member->getMembership().getPendingFees();
+                            if (fee > 0) out << member->getMemberId() << ',' << fee << '\n';
+                        }
+                    });
+                if (!feesOk) cerr << "Warning: could not write fees.csv.\n";
+                circulationOk = circulationOk && feesOk;
+
+                if (circulationOk) {
+                    forEachDirtyRecord(dirty, slots, [this](size_t i) {
+                        if (memberDatabase[i]) memberDatabase[i]->getMembership().clearDirty();
+                    });
+                    circulationChanged = false;
+                }
+                wrote = true;
+            }
+            if (membersOk && circulationOk) memberSlotDirty.assign(slots, false);
+
+            // The snapshot goes last so its timestamp is not older than the CSVs
+            if (useSnapshot && (wrote || !snapshotCurrent)) {
+                exportSnapshot();
+                snapshotCurrent = true;
+            }
+        }
+
+        static size_t segmentStart(size_t segment) { return segment * CSV_SEGMENT_RECORDS; }
+        static size_t segmentEnd(size_t segment, size_t records) {
+            return min(records, (segment + 1) * CSV_SEGMENT_RECORDS);
+        }
+
+        // One flag per segment of records, set if any record in it is dirty
+        template <typename IsDirty>
+        static vector<bool> dirtySegments(size_t records, IsDirty isDirty) {
+            vector<bool> dirty((records + CSV_SEGMENT_RECORDS - 1) / CSV_SEGMENT_RECORDS, false);
+            for (size_t i = 0; i < records; i++) {
+                if (!dirty[i / CSV_SEGMENT_RECORDS] && isDirty(i)) dirty[i / CSV_SEGMENT_RECORDS] = true;
+            }
+            return dirty;
+        }
+
+        template <typename Action>
+        static void forEachDirtyRecord(const vector<bool>& dirty, size_t records, Action action) {
+            for (size_t segment = 0; segment < dirty.size(); segment++) {
+                if (!dirty[segment]) continue;
+                for (size_t i = segmentStart(segment); i < segmentEnd(segment, records); i++) action(i);
+            }
+        }
+
+        // After startup the files on disk match the library; only a missing
+        // file, or a snapshot the CSVs were loaded over, still needs writing
+        void markLoadedFilesClean(bool fromSnapshot) {
+            catalogChanged = fileModifiedTime(dataPath("book.csv")) == 0;
+            membersChanged = fileModifiedTime(dataPath("members.csv")) == 0;
+            circulationChanged = fileModifiedTime(dataPath("checkouts.csv")) == 0 ||
+                                 fileModifiedTime(dataPath("fees.csv")) == 0;
+            snapshotCurrent = fromSnapshot;
+        }
+    };
+// One client's command stream: each request line is a JSON operation and
+// gets one JSON result line. Batch mode runs a file through one session;
+// the server keeps one per connection. Operations run in the scope of the
+// member named by the last "login"; staff operations need a librarian session.
+//   {"op":"login","member":"STU1"}       {"op":"logout"}
+//   {"op":"checkout","isbn":"LIT001"}    {"op":"return","isbn":"LIT001"}
+//   {"op":"reserve","isbn":"LIT002"}     {"op":"pay","amount":20}
+//   {"op":"search","query":"data"}     {"op":"complete","prefix":"LIT0","limit":5}
+//   {"op":"search","query":"algoritm","fuzzy":true}
+//   {"op":"add_book","isbn":..,"title":..,"author":..,"publisher":..,"year":2020}
+//   {"op":"remove_book","isbn":..}       {"op":"remove_member","id":..}
+//   {"op":"add_member","id":..,"name":..,"type":"student"}
+//   {"op":"filter","publisher":..,"from":2019,"to":2023,"availability":"available","sort":"title"}
+//   {"op":"metrics"}                     {"op":"metrics","format":"prometheus"}
+class CommandSession {
+private:
+    LibrarySystem& library;
+    string replies;     // result lines not yet taken by the caller
+    string memberId;    // looked up per request: another session may remove the member
+    size_t failures = 0;
+
+    static string field(const unordered_map<string, string>& fields, const string& key) {
+        auto it = fields.find(key);
+        return it == fields.end() ? "" : it->second;
+    }
+
+    void result(size_t line, const string& op, const string& status, const string& extra = "") {
+        if (status != "ok") failures++;
+        replies += "{\"line\":" + to_string(line) + ",\"op\":" + jsonQuote(op) +
+                   ",\"ok\":" + (status == "ok" ? "true" : "false") +
+                   ",\"status\":" + jsonQuote(status);
+        replies += extra;
+        replies += "}\n";
+    }
+
+    // Start a book's result object with its ISBN and title
+    static void openBookResult(string& out, const Book& item) {
+        out += "{\"isbn\":";
+        appendJsonQuoted(out, item.getISBN());
+        out += ",\"title\":";
+        appendJsonQuoted(out, item.getName());
+    }
+
+    void execute(size_t line, const unordered_map<string, string>& fields) {
+        string op = field(fields, "op");
+        if (op == "login") {
+            Member* member = library.findMember(field(fields, "member"));
+            if (member) memberId = member->getMemberId();
+            result(line, op, member ? "ok" : "not_found");
+            return;
+        }
+        if (op == "logout") {
+            memberId.clear();
+            result(line, op, "ok");
+            return;
+        }
+        if (op == "metrics") {
+            const LibraryMetrics& metrics = library.getMetrics();
+            if (field(fields, "format") == "prometheus") result(line, op, "ok", ",\"text\":" + jsonQuote(metrics.prometheus()));
+            else result(line, op, "ok", ",\"metrics\":" + metrics.json());
+            return;
+        }
+        Member* session = memberId.empty() ? nullptr : library.findMember(memberId);
+        if (!session) {
+            result(line, op, "no_session");
+            return;
+        }
+
+        bool isStaff = session->getKind() == MemberKind::Librarian;
+        if (op == "checkout") {
+            result(line, op, statusCode(library.tryCheckout(session, field(fields, "isbn"))));
+        } else if (op == "return") {
+            int fee = 0;
+            OpStatus status = library.tryReturn(session, field(fields, "isbn"), &fee);
+            result(line, op, statusCode(status), status == OpStatus::Ok ? ",\"fee\":" + to_string(fee) : "");
+        } else if (op == "reserve") {
+            result(line, op, statusCode(library.tryReserve(session, field(fields, "isbn"))));
+        } else if (op == "pay") {
+            string amountText = field(fields, "amount");
+            double amount = session->getMembership().getPendingFees();
+            if (!amountText.empty()) {
+                FieldView amountField = {amountText.data(), amountText.size()};
+                if (!parseDouble(amountField, amount) || amount < 0) {
+                    result(line, op, "bad_request");
+                    return;
+                }
+            }
+            library.payFees(session, amount);
+            ostringstream extra;
+            extra << ",\"pending\":" << session->getMembership().getPendingFees();
+            result(line, op, "ok", extra.str());
+        } else if (op == "search") {
+            // A fuzzy search also reports each book's edit distance
+            CatalogSnapshot view = library.snapshot();
+            vector<BookHandle> matches;
+            vector<int> distances;
+            if (field(fields, "fuzzy") == "true") {
+                for (const FuzzyMatch& match : library.findFuzzyMatches(field(fields, "query"), 50)) {
+                    matches.push_back(match.book);
+                    distances.push_back(match.distance);
+                }
+            } else {
+                matches = library.findMatches(view, field(fields, "query"));
+            }
+
+            string extra = ",\"results\":[";
+            for (size_t i = 0, written = 0; i < matches.size(); i++) {
+                if (!view.contains(matches[i])) continue;
+                const Book& item = view.book(matches[i]);
+                if (written++) extra += ",";
+                openBookResult(extra, item);
+                extra += ",\"author\":";
+                appendJsonQuoted(extra, item.getCreator());
+                extra += ",\"availability\":\"";
+                extra += availabilityName(view.state(matches[i]));
+                extra += '"';
+                if (!distances.empty()) extra += ",\"distance\":" + to_string(distances[i]);
+                extra += "}";
+            }
+            result(line, op, "ok", extra + "]");
+        } else if (op == "complete") {
+            long long limit = 10;
+            string limitText = field(fields, "limit");
+            if (!limitText.empty()) {
+                FieldView limitField = {limitText.data(), limitText.size()};
+                if (!parseInt64(limitField, limit) || limit <= 0) {
+                    result(line, op, "bad_request");
+                    return;
+                }
+            }
+            // Books and states are read from a snapshot pinned before the
+            // lookup, as in search, so a concurrent removal cannot pull a
+            // slot out from under the reply
+            CatalogSnapshot view = library.snapshot();
+            string extra = ",\"results\":[";
+            vector<BookHandle> matches = library.completePrefix(field(fields, "prefix"), static_cast<size_t>(limit));
+            for (size_t i = 0, written = 0; i < matches.size(); i++) {
+                if (!view.contains(matches[i])) continue;
+                const Book& item = view.book(matches[i]);
+                if (written++) extra += ",";
+                openBookResult(extra, item);
+                extra += ",\"author\":";
+                appendJsonQuoted(extra, item.getCreator());
+                extra += ",\"availability\":\"";
+                extra += availabilityName(view.state(matches[i]));
+                extra += "\"}";
+            }
+            result(line, op, "ok", extra + "]");
+        } else if (op == "filter") {
+            // Every field is optional: publisher, from and to years,
+            // availability as a comma-separated list of states, sort
+            // (isbn, title or year) and limit
+            CatalogFilter filter;
+            filter.publisher = field(fields, "publisher");
+            long long from = filter.fromYear, to = filter.toYear, limit = 50;
+            string fromText = field(fields, "from"), toText = field(fields, "to"), limitText = field(fields, "limit");
+            FieldView fromField = {fromText.data(), fromText.size()}, toField = {toText.data(), toText.size()};
+            FieldView limitField = {limitText.data(), limitText.size()};
+            if ((!fromText.empty() && !parseInt64(fromField, from)) || (!toText.empty() && !parseInt64(toField, to)) ||
+                (!limitText.empty() && (!parseInt64(limitField, limit) || limit <= 0))) {
+                result(line, op, "bad_request");
+                return;
+            }
+            filter.fromYear = static_cast<int32_t>(max<long long>(from, INT32_MIN));
+            filter.toYear = static_cast<int32_t>(min<long long>(to, INT32_MAX));
+            string states = field(fields, "availability");
+            for (size_t start = 0; start < states.size();) {
+                size_t comma = states.find(',', start);
+                if (comma == string::npos) comma = states.size();
+                string state = states.substr(start, comma - start);
+                if (availabilityName(parseAvailability(state)) != state) {
+                    result(line, op, "bad_request");
+                    return;
+                }
+                filter.states.push_back(parseAvailability(state));
+                start = comma + 1;
+            }
+            string sort = field(fields, "sort");
+            if (!sort.empty() && sort != "isbn" && sort != "title" && sort != "year") {
+                result(line, op, "bad_request");
+                return;
+            }
+            CatalogOrder order = sort == "isbn" ? CatalogOrder::Isbn : sort == "title" ? CatalogOrder::Title : CatalogOrder::Year;
+
+            CatalogSnapshot view = library.snapshot();
+            string extra = ",\"results\":[";
+            vector<BookHandle> matches = library.filterCatalog(filter, order, static_cast<size_t>(limit));
+            for (size_t i = 0, written = 0; i < matches.size(); i++) {
+                if (!view.contains(matches[i])) continue;
+                const Book& item = view.book(matches[i]);
+                if (written++) extra += ",";
+                openBookResult(extra, item);
+                extra += ",\"publisher\":";
+                appendJsonQuoted(extra, item.getCompany());
+                extra += ",\"year\":" + to_string(item.getPublicationYear()) + ",\"availability\":\"";
+                extra += availabilityName(view.state(matches[i]));
+                extra += "\"}";
+            }
+            result(line, op, "ok", extra + "]");
+        } else if (op == "add_book" || op == "remove_book" || op == "add_member" || op == "remove_member") {
+            if (!isStaff) {
+                result(line, op, "forbidden");
+            } else if (op == "add_book") {
+                long long year;
+                string yearText = field(fields, "year"), isbn = field(fields, "isbn");
+                string title = field(fields, "title"), author = field(fields, "author"), publisher = field(fields, "publisher");
+                FieldView yearField = {yearText.data(), yearText.size()};
+                if (isbn.empty() || !parseInt64(yearField, year) || !fitsCsvField(isbn) || !fitsCsvField(title) ||
+                    !fitsCsvField(author) || !fitsCsvField(publisher)) {
+                    result(line, op, "bad_request");
+                    return;
+                }
+                bool added = library.addbook(Book(isbn, title, static_cast<int>(year), author, publisher));
+                result(line, op, added ? "ok" : "duplicate");
+            } else if (op == "remove_book") {
+                string isbn = field(fields, "isbn");
+                if (!library.findbook(isbn)) {
+                    result(line, op, "not_found");
+                    return;
+                }
+                library.removebook(isbn);
+                result(line, op, "ok");
+            } else if (op == "add_member") {
+                MemberKind kind;
+                if (!parseMemberKind(field(fields, "type"), kind) || field(fields, "id").empty() ||
+                    !fitsCsvField(field(fields, "id")) || !fitsCsvField(field(fields, "name"))) {
+                    result(line, op, "bad_request");
+                    return;
+                }
+                result(line, op, library.registerMember(field(fields, "id"), field(fields, "name"), kind) ? "ok" : "duplicate");
+            } else {
+                string id = field(fields, "id");
+                if (!library.findMember(id)) {
+                    result(line, op, "not_found");
+                    return;
+                }
+                if (memberId == id) memberId.clear();
+                library.removeMember(id);
+                result(line, op, "ok");
+            }
+        } else {
+            result(line, op, "unknown_op");
+        }
+    }
+
+public:
+    explicit CommandSession(LibrarySystem& system) : library(system) {}
+
+    // Run one request line, without its newline; a blank line gets no result
+    void handleLine(size_t line, const char* begin, const char* end) {
+        while (begin < end && isspace(static_cast<unsigned char>(*begin))) begin++;
+        if (begin == end) return;
+        unordered_map<string, string> fields;
+        bool parsed = false;
+        try {
+            parsed = parseJsonObject(begin, end, fields);
+        } catch (const exception&) {
+            parsed = false;
+        }
+        if (parsed) execute(line, fields);
+        else result(line, "", "bad_request");
+    }
+
+    // Result lines produced so far; the caller sends them and clears it
+    string& pendingReplies() { return replies; }
+    size_t failureCount() const { return failures; }
+};
+
+// Run every line of the input through one session; returns the number of
+// failed operations
+size_t runCommandFile(LibrarySystem& library, const MappedFile& input, BufferedWriter& out) {
+    CommandSession session(library);
+    const char* p = input.data();
+    const char* end = p + input.size();
+    size_t line = 0;
+    while (p < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!lineEnd) lineEnd = end;
+        session.handleLine(++line, p, lineEnd);
+        out << session.pendingReplies();
+        session.pendingReplies().clear();
+        p = lineEnd + 1;
+    }
+    library.syncJournal();
+    return session.failureCount();
+}
+
+int runBatch(const string& inputPath, const string& outputPath, bool binarySnapshot) {
+    MappedFile input;
+    if (!input.open(inputPath)) {
+        cerr << "Cannot open " << inputPath << "\n";
+        return 1;
+    }
+    int fd = outputPath.empty() ? STDOUT_FILENO : ::open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "Cannot open " << outputPath << "\n";
+        return 1;
+    }
+
+    size_t failures;
+    {
+        LibrarySystem system(binarySnapshot);
+        BufferedWriter writer(fd, 1 << 20);
+        failures = runCommandFile(system, input, writer);
+    }
+    if (fd != STDOUT_FILENO) ::close(fd);
+    cerr << "Batch finished, " << failures << " operation(s) failed.\n";
+    return 0;
+}
+
+// Server mode: one process keeps the library and serves every desk
+// terminal over a Unix domain socket or a loopback TCP port, instead of
+// each terminal loading, and later overwriting, its own copy of the files.
+// The protocol is batch mode's: each request is one JSON line and gets one
+// result line, in order. Clients may pipeline: every complete line a read
+// delivers is run, and the results go back in one write.
+const size_t MAX_REQUEST_LINE = 1 << 20;     // a longer line closes the connection
+const size_t MAX_UNSENT_REPLIES = 4 << 20;   // stop reading a client this far behind
+
+// Fill in the address of a Unix socket path, or of 127.0.0.1:port when the
+// endpoint is a number; false if the path is too long or the port invalid
+bool resolveEndpoint(const string& endpoint, sockaddr_storage& address, socklen_t& length) {
+    memset(&address, 0, sizeof address);
+    bool numeric = !endpoint.empty() &&
+                   all_of(endpoint.begin(), endpoint.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)); });
+    if (numeric) {
+        unsigned long port = endpoint.size() <= 5 ? stoul(endpoint) : 0;
+        if (port == 0 || port > 65535) return false;
+        sockaddr_in& inet = reinterpret_cast<sockaddr_in&>(address);
+        inet.sin_family = AF_INET;
+        inet.sin_port = htons(static_cast<uint16_t>(port));
+        inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        length = sizeof inet;
+        return true;
+    }
+    sockaddr_un& local = reinterpret_cast<sockaddr_un&>(address);
+    if (endpoint.size() >= sizeof local.sun_path) return false;
+    local.sun_family = AF_UNIX;
+    memcpy(local.sun_path, endpoint.data(), endpoint.size());
+    length = sizeof local;
+    return true;
+}
+
+// Allow as many open sockets as the hard limit does
+void raiseDescriptorLimit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+volatile sig_atomic_t serverStopRequested = 0;
+void requestServerStop(int) { serverStopRequested = 1; }
+
+// Single-threaded epoll loop over the listening socket and the clients.
+// Each connection has its own CommandSession, so logins are per terminal.
+class LibraryServer {
+private:
+    struct Connection {
+        int fd;
+        CommandSession session;
+        string input;           // received requests not run yet
+        size_t lines = 0;
+        size_t sent = 0;        // bytes of the pending replies already written
+        uint32_t events = EPOLLIN;
+        bool inputEnded = false;   // end of input, a read error or an overlong line
+        bool touched = false;      // has replies to send this pass
+        Connection(int socket, LibrarySystem& library) : fd(socket), session(library) {}
+    };
+
+    LibrarySystem& library;
+    int listener = -1, poller = -1, spare = -1;
+    string socketPath;          // Unix socket to remove on shutdown
+    bool tcp = false;
+    unordered_map<int, unique_ptr<Connection>> connections;
+    vector<Connection*> touched;
+    size_t accepted = 0, requests = 0;
+
+    static size_t unsent(Connection& client) { return client.session.pendingReplies().size() - client.sent; }
+
+    // A request is waiting in the input; after the end of input the last
+    // line counts even without its newline, as in batch mode
+    static bool requestWaiting(const Connection& client) {
+        return client.input.find('\n') != string::npos || (client.inputEnded && !client.input.empty());
+    }
+
+    void acceptClients() {
+        while (true) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if ((errno == EMFILE || errno == ENFILE) && spare >= 0) {
+                    // Out of descriptors: turn the client away rather than
+                    // leave it pending, which would wake the loop at once
+                    close(spare);
+                    fd = accept(listener, nullptr, nullptr);
+                    if (fd >= 0) close(fd);
+                    spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    if (fd >= 0) continue;
+                }
+                return;
+            }
+            if (tcp) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+            }
+            unique_ptr<Connection> client(new Connection(fd, library));
+            epoll_event event = {};
+            event.events = client->events;
+            event.data.ptr = client.get();
+            if (epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event) < 0) {
+                close(fd);
+                continue;
+            }
+            connections[fd] = move(client);
+            accepted++;
+        }
+    }
+
+    // Run the requests received so far, until the client is too far behind
+    // on its results; the rest wait in the input
+    void runLines(Connection& client) {
+        size_t start = 0;
+        while (unsent(client) < MAX_UNSENT_REPLIES) {
+            size_t end = client.input.find('\n', start);
+            if (end == string::npos) {
+                if (!client.inputEnded || start == client.input.size()) break;
+                end = client.input.size();
+            }
+            client.session.handleLine(++client.lines, client.input.data() + start, client.input.data() + end);
+            requests++;
+            start = min(end + 1, client.input.size());
+        }
+        client.input.erase(0, start);
+        if (client.input.size() > MAX_REQUEST_LINE && !requestWaiting(client)) {
+            client.inputEnded = true;
+            client.input.clear();
+        }
+    }
+
+    // Read and run requests while the client keeps up with its results
+    void readRequests(Connection& client) {
+        char buffer[1 << 16];
+        runLines(client);
+        while (!client.inputEnded && unsent(client) < MAX_UNSENT_REPLIES) {
+            ssize_t n = read(client.fd, buffer, sizeof buffer);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) return;
+            if (n <= 0) client.inputEnded = true;
+            else client.input.append(buffer, n);
+            runLines(client);
+        }
+    }
+
+    // Send what the socket takes, then watch for room to send the rest. A
+    // client that is not reading its results is not read from either, so
+    // the results held for it stay near MAX_UNSENT_REPLIES.
+    void writeReplies(Connection& client) {
+        string& replies = client.session.pendingReplies();
+        while (client.sent < replies.size()) {
+            ssize_t n = send(client.fd, replies.data() + client.sent, replies.size() - client.sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                client.sent += n;
+            } else if (n < 0 && errno == EAGAIN) {
+                break;
+            } else if (n < 0 && errno != EINTR) {
+                // The client is gone; drop what it sent and what it was owed
+                client.inputEnded = true;
+                client.input.clear();
+                client.sent = replies.size();
+            }
+        }
+        if (client.sent == replies.size()) {
+            replies.clear();
+            client.sent = 0;
+        }
+        if (client.inputEnded && client.input.empty() && replies.empty()) {
+            int fd = client.fd;
+            close(fd);
+            connections.erase(fd);
+            return;
+        }
+        // Requests left in the input run once the socket can take more
+        uint32_t wanted = (replies.empty() && !requestWaiting(client) ? 0 : uint32_t(EPOLLOUT)) |
+                          (client.inputEnded || unsent(client) >= MAX_UNSENT_REPLIES ? 0 : uint32_t(EPOLLIN));
+        if (wanted != client.events) {
+            epoll_event event = {};
+            event.events = wanted;
+            event.data.ptr = &client;
+            epoll_ctl(poller, EPOLL_CTL_MOD, client.fd, &event);
+            client.events = wanted;
+        }
+    }
+
+public:
+    explicit LibraryServer(LibrarySystem& system) : library(system) {}
+    LibraryServer(const LibraryServer&) = delete;
+    LibraryServer& operator=(const LibraryServer&) = delete;
+
+    ~LibraryServer() {
+        for (const auto& client : connections) close(client.first);
+        if (listener >= 0) close(listener);
+        if (poller >= 0) close(poller);
+        if (spare >= 0) close(spare);
+        if (!socketPath.empty()) unlink(socketPath.c_str());
+    }
+
+    size_t connectionsAccepted() const { return accepted; }
+    size_t requestsServed() const { return requests; }
+
+    // Listen on a Unix socket path or a loopback port. A stale socket file
+    // is replaced; one another server still answers on is not.
+    bool listen(const string& endpoint) {
+        sockaddr_storage address;
+        socklen_t length;
+        errno = 0;
+        if (!resolveEndpoint(endpoint, address, length)) return false;
+        tcp = address.ss_family == AF_INET;
+        if (!tcp) {
+            struct stat info;
+            if (stat(endpoint.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+                int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                bool live = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&address), length) == 0;
+                if (probe >= 0) close(probe);
+                if (live) {
+                    errno = EADDRINUSE;
+                    return false;
+                }
+                unlink(endpoint.c_str());
+            }
+        }
+
+        listener = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener < 0) return false;
+        int on = 1;
+        if (tcp) setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), length) < 0) return false;
+        if (!tcp) socketPath = endpoint;
+        if (::listen(listener, SOMAXCONN) < 0) return false;
+
+        poller = epoll_create1(EPOLL_CLOEXEC);
+        if (poller < 0) return false;
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;   // the listener; clients carry their Connection
+        spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return epoll_ctl(poller, EPOLL_CTL_ADD, listener, &event) == 0;
+    }
+
+    // Serve until SIGINT or SIGTERM, which are taken only while waiting,
+    // with `waitMask` as the signal mask. The nightly fee accrual runs a
+    // day after the last one, so it needs no second process on the files.
+    void run(const sigset_t& waitMask) {
+        epoll_event events[256];
+        TimePoint nextAccrual = library.now() + ONE_DAY;
+        while (!serverStopRequested) {
+            int ready = epoll_pwait(poller, events, 256, 60 * 1000, &waitMask);
+            if (ready < 0 && errno != EINTR) {
+                cerr << "epoll_pwait: " << strerror(errno) << "\n";
+                break;
+            }
+            for (int i = 0; i < ready; i++) {
+                if (!events[i].data.ptr) {
+                    acceptClients();
+                    continue;
+                }
+                Connection& client = *static_cast<Connection*>(events[i].data.ptr);
+                readRequests(client);
+                if (!client.touched) {
+                    client.touched = true;
+                    touched.push_back(&client);
+                }
+            }
+            // Results go out once the changes they report are on disk; one
+            // flush covers every client served in this pass
+            library.syncJournal();
+            for (Connection* client : touched) {
+                client->touched = false;
+                writeReplies(*client);
+            }
+            touched.clear();
+
+            TimePoint now = library.now();
+            if (now >= nextAccrual) {
+                library.runFeeAccrual(now);
+                nextAccrual = now + ONE_DAY;
+            }
+        }
+    }
+};
+
+int runServer(const string& endpoint, bool binarySnapshot) {
+    raiseDescriptorLimit();
+    // Block the stop signals before the library starts its threads, so
+    // that only the event loop's wait takes them
+    sigset_t stopSignals, waitMask;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &waitMask);
+    struct sigaction action = {};
+    action.sa_handler = requestServerStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    LibrarySystem system(binarySnapshot);
+    system.runFeeAccrual(system.now());
+    LibraryServer server(system);
+    if (!server.listen(endpoint)) {
+        cerr << "Cannot listen on " << endpoint << (errno ? string(": ") + strerror(errno) : "") << "\n";
+        return 1;
+    }
+    cerr << "Serving on " << endpoint << ", stop with Ctrl-C.\n";
+    server.run(waitMask);
+    cerr << "Served " << server.requestsServed() << " request(s) on " << server.connectionsAccepted()
+         << " connection(s).\n";
+    return 0;
+}
+
+// Load generator for server mode. Each connection logs in as a borrowing
+// member and keeps up to `depth` requests in flight: checkouts, returns of
+// its own loans, reservations, prefix completions and searches over books
+// sampled from the data files in the current directory. Latency runs from
+// when a request is queued to when its result line arrives.
+enum class LoadOp { Login, Checkout, Return, Reserve, Complete, Search };
+const char* const LOAD_OP_NAMES[] = {"login", "checkout", "return", "reserve", "complete", "search"};
+const size_t LOAD_OP_COUNT = 6;
+
+int runLoadGenerator(const string& endpoint, size_t connectionCount, size_t requestsPerConnection, size_t depth) {
+    sockaddr_storage address;
+    socklen_t length;
+    if (!resolveEndpoint(endpoint, address, length) || connectionCount == 0 || depth == 0) {
+        cerr << "Usage: main --loadgen <socket-path|port> [connections] [requests-per-connection] [pipeline-depth]\n";
+        return 1;
+    }
+
+    // Borrowing members, and books with the first half of their title as
+    // typed into a search, as in --bench
+    const size_t SAMPLE = 4096;
+    mt19937 rng(1);
+    vector<string> memberIds, isbns, queries;
+    {
+        MappedFile members, books;
+        if (members.open(dataFileName(".", "members.csv", "users.csv"))) {
+            CsvScanner scanner(members);
+            FieldView m[3];
+            MemberKind kind;
+            while (scanner.nextRecord(m, 3)) {
+                if (memberIds.size() < SAMPLE * 16 && parseMemberKind(m[2].str(), kind) && kind != MemberKind::Librarian) {
+                    memberIds.push_back(m[0].str());
+                }
+            }
+        }
+        if (books.open(dataFileName(".", "book.csv", "books.csv"))) {
+            CsvScanner scanner(books);
+            FieldView f[7];
+            long long year;
+            for (size_t seen = 0; scanner.nextRecord(f, 7);) {
+                if (!parseInt64(f[4], year)) continue;   // the shipped file's header
+                seen++;
+                size_t slot = isbns.size() < SAMPLE ? isbns.size() : rng() % seen;
+                if (slot >= SAMPLE) continue;
+                if (slot == isbns.size()) {
+                    isbns.emplace_back();
+                    queries.emplace_back();
+                }
+                isbns[slot] = f[0].str();
+                queries[slot] = f[1].str().substr(0, f[1].size / 2);
+            }
+        }
+    }
+    if (memberIds.empty() || isbns.empty()) {
+        cerr << "No members or books in the current directory to drive the load from.\n";
+        return 1;
+    }
+    raiseDescriptorLimit();
+
+    struct Pending {
+        LoadOp op;
+        string isbn;
+        chrono::steady_clock::time_point queued;
+    };
+    struct LoadConnection {
+        int fd = -1;
+        string output, input;
+        size_t sent = 0, issued = 0, answered = 0;
+        uint32_t events = EPOLLIN;
+        deque<Pending> inFlight;
+        vector<string> loans;
+    };
+
+    int poller = epoll_create1(EPOLL_CLOEXEC);
+    vector<LoadConnection> clients(connectionCount);
+    LatencyHistogram latency[LOAD_OP_COUNT];
+    size_t succeeded[LOAD_OP_COUNT] = {}, dropped = 0;
+
+    auto queue = [&](LoadConnection& client, LoadOp op, const string& isbn, const string& request) {
+        client.output += request;
+        client.output += '\n';
+        client.inFlight.push_back(Pending{op, isbn, chrono::steady_clock::now()});
+    };
+    auto issue = [&](LoadConnection& client) {
+        unsigned roll = rng() % 100;
+        const string& isbn = isbns[rng() % isbns.size()];
+        if (!client.loans.empty() && roll < 30) {
+            string loan = client.loans.back();
+            client.loans.pop_back();
+            queue(client, LoadOp::Return, loan, "{\"op\":\"return\",\"isbn\":" + jsonQuote(loan) + "}");
+        } else if (roll < 55) {
+            queue(client, LoadOp::Checkout, isbn, "{\"op\":\"checkout\",\"isbn\":" + jsonQuote(isbn) + "}");
+        } else if (roll < 65) {
+            queue(client, LoadOp::Reserve, isbn, "{\"op\":\"reserve\",\"isbn\":" + jsonQuote(isbn) + "}");
+        } else if (roll < 90) {
+            queue(client, LoadOp::Complete, "",
+                  "{\"op\":\"complete\",\"prefix\":" + jsonQuote(isbn.substr(0, 3 + rng() % 3)) + ",\"limit\":5}");
+        } else {
+            queue(client, LoadOp::Search, "", "{\"op\":\"search\",\"query\":" + jsonQuote(queries[rng() % queries.size()]) + "}");
+        }
+        client.issued++;
+    };
+    auto watch = [&](LoadConnection& client, uint32_t wanted) {
+        if (wanted == client.events) return;
+        epoll_event event = {};
+        event.events = wanted;
+        event.data.u64 = &client - clients.data();
+        epoll_ctl(poller, EPOLL_CTL_MOD, client.fd, &event);
+        client.events = wanted;
+    };
+    auto flushOutput = [&](LoadConnection& client) {
+        while (client.sent < client.output.size()) {
+            ssize_t n = send(client.fd, client.output.data() + client.sent, client.output.size() - client.sent, MSG_NOSIGNAL);
+            if (n > 0) client.sent += n;
+            else if (n < 0 && errno == EINTR) continue;
+            else break;
+        }
+        if (client.sent == client.output.size()) {
+            client.output.clear();
+            client.sent = 0;
+        }
+        watch(client, EPOLLIN | (client.output.empty() ? 0 : uint32_t(EPOLLOUT)));
+    };
+
+    size_t connected = 0;
+    for (size_t i = 0; i < connectionCount; i++) {
+        LoadConnection& client = clients[i];
+        client.fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (client.fd < 0 || connect(client.fd, reinterpret_cast<sockaddr*>(&address), length) < 0) {
+            cerr << "Cannot connect to " << endpoint << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) | O_NONBLOCK);
+        if (address.ss_family == AF_INET) {
+            int on = 1;
+            setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        }
+        epoll_event event = {};
+        event.events = client.events;
+        event.data.u64 = i;
+        epoll_ctl(poller, EPOLL_CTL_ADD, client.fd, &event);
+        connected++;
+    }
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < connectionCount; i++) {
+        LoadConnection& client = clients[i];
+        const string& member = memberIds[i % memberIds.size()];
+        queue(client, LoadOp::Login, "", "{\"op\":\"login\",\"member\":" + jsonQuote(member) + "}");
+        while (client.issued < requestsPerConnection && client.inFlight.size() < depth) issue(client);
+        flushOutput(client);
+    }
+
+    vector<epoll_event> events(256);
+    char buffer[1 << 16];
+    while (connected > 0) {
+        int ready = epoll_wait(poller, events.data(), static_cast<int>(events.size()), -1);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) break;
+        for (int e = 0; e < ready; e++) {
+            LoadConnection& client = clients[events[e].data.u64];
+            if (client.fd < 0) continue;
+            bool lost = false;
+            while (true) {
+                ssize_t n = read(client.fd, buffer, sizeof buffer);
+                if (n > 0) {
+                    client.input.append(buffer, n);
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) continue;
+                lost = n == 0 || errno != EAGAIN;
+                break;
+            }
+
+            size_t begin = 0;
+            auto now = chrono::steady_clock::now();
+            for (size_t newline; (newline = client.input.find('\n', begin)) != string::npos; begin = newline + 1) {
+                if (client.inFlight.empty()) break;
+                Pending request = move(client.inFlight.front());
+                client.inFlight.pop_front();
+                client.answered++;
+                size_t op = static_cast<size_t>(request.op);
+                latency[op].record(chrono::duration_cast<chrono::nanoseconds>(now - request.queued).count());
+                const char* line = client.input.data() + begin;
+                const char* lineEnd = client.input.data() + newline;
+                const char okField[] = "\"ok\":true";
+                bool ok = search(line, lineEnd, okField, okField + sizeof okField - 1) != lineEnd;
+                if (ok) succeeded[op]++;
+                if (ok && request.op == LoadOp::Checkout) client.loans.push_back(request.isbn);
+            }
+            client.input.erase(0, begin);
+
+            while (client.issued < requestsPerConnection && client.inFlight.size() < depth) issue(client);
+            if (!lost) flushOutput(client);
+            if (lost || client.inFlight.empty()) {
+                if (!client.inFlight.empty()) dropped++;
+                close(client.fd);
+                client.fd = -1;
+                connected--;
+            }
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    close(poller);
+
+    size_t total = 0;
+    cout << fixed;
+    cout.precision(1);
+    cout << "connections: " << connectionCount << ", pipeline depth " << depth << ", " << requestsPerConnection
+         << " requests each\n";
+    for (size_t op = 0; op < LOAD_OP_COUNT; op++) {
+        const LatencyHistogram& histogram = latency[op];
+        if (histogram.count() == 0) continue;
+        total += histogram.count();
+        cout << LOAD_OP_NAMES[op] << ": " << histogram.count() << " (" << succeeded[op] << " ok), p50 "
+             << histogram.percentile(0.5) / 1000.0 << " us, p99 " << histogram.percentile(0.99) / 1000.0
+             << " us, max " << histogram.maxNanos() / 1000.0 << " us\n";
+    }
+    cout.precision(0);
+    cout << "throughput: " << total / seconds << " requests/s over " << seconds * 1000 << " ms\n";
+    if (dropped) cout << "connections lost before their last result: " << dropped << "\n";
+    return dropped ? 1 : 0;
+}
+
+// Nightly job: accrue late fees and print the overdue report
+int runNightly(bool binarySnapshot) {
+    LibrarySystem system(binarySnapshot);
+    TimePoint now = system.now();
+    size_t charged = system.runFeeAccrual(now);
+    vector<OverdueLoan> overdue = system.getOverdueLoans(now);
+    for (const OverdueLoan& loan : overdue) {
+        cout << loan.isbn << "," << loan.memberId << "," << loan.daysOverdue << "\n";
+    }
+    cerr << "Late fees accrued on " << charged << " loan(s), " << overdue.size() << " loan(s) overdue.\n";
+    return 0;
+}
+
+// Parse a YYYY-MM-DD date as midnight UTC
+bool parseDate(const string& text, TimePoint& when) {
+    struct tm date = {};
+    char rest;
+    if (sscanf(text.c_str(), "%4d-%2d-%2d%c", &date.tm_year, &date.tm_mon, &date.tm_mday, &rest) != 3) return false;
+    if (date.tm_mon < 1 || date.tm_mon > 12 || date.tm_mday < 1 || date.tm_mday > 31) return false;
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    when = chrono::system_clock::from_time_t(timegm(&date));
+    return true;
+}
+
+// Nightly job: circulation reports over the loan history. The top titles
+// cover checkouts in [from, to), by default the 30 days up to and
+// including today.
+int runReport(const vector<string>& dates, bool binarySnapshot) {
+    const chrono::hours DAY(24);
+    long long today = chrono::duration_cast<chrono::hours>(chrono::system_clock::now().time_since_epoch()).count() / 24;
+    TimePoint to = TimePoint(DAY * (today + 1)), from = to - DAY * 30;
+    if ((dates.size() > 0 && !parseDate(dates[0], from)) || (dates.size() > 1 && !parseDate(dates[1], to))) {
+        cerr << "Dates are YYYY-MM-DD\n";
+        return 1;
+    }
+    const size_t TOP_TITLES = 10;
+
+    LibrarySystem system(binarySnapshot);
+    auto start = chrono::steady_clock::now();
+    vector<pair<string, size_t>> top = system.getMostBorrowed(from, to, TOP_TITLES);
+    vector<CirculationHistory::LoanDuration> durations = system.getAverageLoanDays();
+    vector<pair<string, double>> revenue = system.getRevenueByMonth();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "Most borrowed titles\n";
+    for (const auto& entry : top) {
+        Book* item = system.findbook(entry.first);
+        cout << "  " << entry.second << "  " << entry.first << "  " << (item ? item->getName() : string("(removed)")) << "\n";
+    }
+    cout << "Average loan duration (days)\n" << fixed;
+    cout.precision(1);
+    for (const auto& entry : durations) {
+        cout << "  " << entry.memberType << "  " << entry.averageDays << "  (" << entry.loans << " loans)\n";
+    }
+    cout << "Late-fee revenue by month\n";
+    cout.precision(2);
+    for (const auto& entry : revenue) cout << "  " << entry.first << "  " << entry.second << "\n";
+    cerr << "Scanned " << system.getHistorySize() << " loan(s) in " << seconds << " s.\n";
+    return 0;
+}
+
+// Bulk-load a vendor feed into the library in the current directory and
+// write the rows it turned away to <feed>.rejects.csv as line,reason,row
+int runIngest(const string& feedPath, unsigned threadCount, bool binarySnapshot) {
+    LibrarySystem system(binarySnapshot);
+    IngestReport report;
+    if (!system.ingestCatalog(feedPath, threadCount, report)) {
+        cerr << "Cannot open " << feedPath << "\n";
+        return 1;
+    }
+
+    string rejectsPath = feedPath + ".rejects.csv";
+    if (!report.rejected.empty()) {
+        int fd = ::open(rejectsPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            cerr << "Cannot open " << rejectsPath << "\n";
+            return 1;
+        }
+        {
+            BufferedWriter out(fd);
+            out << "line,reason,row\n";
+            for (const RejectedRow& row : report.rejected) {
+                out << row.line << ',' << row.reason << ',' << row.text << '\n';
+            }
+        }
+        ::close(fd);
+    }
+
+    double seconds = report.parseSeconds + report.mergeSeconds;
+    cerr << "Ingested " << report.added << " of " << report.rows << " row(s) with " << threadCount
+         << " thread(s) in " << seconds << " s (parse " << report.parseSeconds << " s, merge "
+         << report.mergeSeconds << " s, " << static_cast<size_t>(report.rows / max(seconds, 1e-9)) << " rows/s).\n";
+    if (!report.rejected.empty()) cerr << report.rejected.size() << " row(s) rejected, see " << rejectsPath << "\n";
+    return 0;
+}
+
+// Remove a scratch data directory created for a benchmark or stress run
+void removeDataDirectory(const string& dir) {
+    for (const char* file : {"book.csv", "members.csv", "checkouts.csv", "fees.csv", "history.csv", "journal.log",
+                             "library.snap", "library.snap.tmp"}) {
+        remove((dir + "/" + file).c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+// Hammer one library from several threads with checkouts, returns and
+// reservations, then check that no book was ever lent twice and that the
+// books' state agrees with the members' loans. Meanwhile reader threads
+// search and page through snapshots while a librarian thread adds and
+// removes books; every snapshot must list exactly its live books, in
+// order, and find every stress book.
+int runStressTest(unsigned threadCount, size_t opsPerThread) {
+    const size_t BOOKS = 256, MEMBERS_PER_THREAD = 16;
+    char dirTemplate[] = "/tmp/library-stress-XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        cerr << "Cannot create scratch directory.\n";
+        return 1;
+    }
+    string dir = dirTemplate;
+
+    unique_ptr<atomic<int>[]> holders(new atomic<int>[BOOKS]);
+    for (size_t i = 0; i < BOOKS; i++) holders[i] = 0;
+    atomic<size_t> violations{0}, checkouts{0}, returns{0}, reservations{0}, reads{0}, catalogChanges{0};
+    atomic<bool> done{false};
+    double seconds;
+    string metrics;
+    {
+        LibrarySystem library(false, dir);
+        for (size_t i = 0; i < BOOKS; i++) {
+            library.addbook(Book("STRESS" + to_string(i), "Stress Title " + to_string(i), 2000, "Author", "Press"));
+        }
+        vector<vector<Member*>> owned(threadCount);
+        for (unsigned t = 0; t < threadCount; t++) {
+            for (size_t m = 0; m < MEMBERS_PER_THREAD; m++) {
+                string id = "T" + to_string(t) + "M" + to_string(m);
+                library.registerMember(id, id, m % 2 ? MemberKind::Faculty : MemberKind::Student);
+                owned[t].push_back(library.findMember(id));
+            }
+        }
+
+        // Each thread owns its members, so only it returns their books; the
+        // holder count is raised after a checkout and dropped before a return
+        auto worker = [&](unsigned t) {
+            mt19937 rng(t + 1);
+            for (size_t op = 0; op < opsPerThread; op++) {
+                Member* member = owned[t][rng() % MEMBERS_PER_THREAD];
+                size_t book = rng() % BOOKS;
+                string isbn = "STRESS" + to_string(book);
+                switch (rng() % 3) {
+                    case 0:
+                        if (library.tryCheckout(member, isbn) == OpStatus::Ok) {
+                            checkouts++;
+                            if (holders[book].fetch_add(1) != 0) violations++;
+                        }
+                        break;
+                    case 1: {
+                        const vector<BorrowInfo>& loans = member->getMembership().getCheckedOutItems();
+                        if (loans.empty()) break;
+                        string loaned = loans[rng() % loans.size()].isbn;
+                        size_t index = stoul(loaned.substr(6));
+                        holders[index]--;
+                        if (library.tryReturn(member, loaned) != OpStatus::Ok) violations++;
+                        returns++;
+                        break;
+                    }
+                    default:
+                        if (library.tryReserve(member, isbn) == OpStatus::Ok) reservations++;
+                }
+            }
+        };
+
+        auto reader = [&] {
+            int devNull = ::open("/dev/null", O_WRONLY);
+            {
+                BufferedWriter out(devNull);
+                while (!done) {
+                    CatalogSnapshot view = library.snapshot();
+                    if (view.findMatches("stress title").size() != BOOKS) violations++;
+                    ListingCursor cursor;
+                    pair<string, string> last;
+                    size_t listed = 0, written;
+                    while ((written = view.writeCatalogPage(out, CatalogOrder::Title, cursor, LISTING_PAGE_SIZE)) > 0) {
+                        if (listed && make_pair(cursor.title, cursor.id) <= last) violations++;
+                        last = make_pair(cursor.title, cursor.id);
+                        listed += written;
+                    }
+                    if (listed != view.liveBooks()) violations++;
+                    reads++;
+                }
+            }
+            ::close(devNull);
+        };
+
+        auto librarian = [&] {
+            const size_t SHELF = 64;
+            for (size_t i = 0; !done; i++) {
+                string isbn = "CHURN" + to_string(i % SHELF);
+                if (i / SHELF % 2 == 0) library.addbook(Book(isbn, "Churn Volume " + to_string(i % SHELF), 1990, "Author", "Press"));
+                else library.removebook(isbn);
+                catalogChanges++;
+            }
+        };
+
+        auto start = chrono::steady_clock::now();
+        vector<thread> workers, readers;
+        for (unsigned t = 0; t < threadCount; t++) workers.emplace_back(worker, t);
+        for (unsigned t = 0; t < threadCount; t++) readers.emplace_back(reader);
+        readers.emplace_back(librarian);
+        for (thread& w : workers) w.join();
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        done = true;
+        for (thread& r : readers) r.join();
+
+        // Final state: every borrowed book has exactly one holder
+        vector<int> loanCount(BOOKS, 0);
+        for (const vector<Member*>& members : owned) {
+            for (Member* member : members) {
+                for (const BorrowInfo& info : member->getMembership().getCheckedOutItems()) {
+                    loanCount[stoul(info.isbn.substr(6))]++;
+                }
+            }
+        }
+        for (size_t i = 0; i < BOOKS; i++) {
+            bool borrowed = library.findbook("STRESS" + to_string(i))->getState() == Availability::Borrowed;
+            if (loanCount[i] > 1 || borrowed != (loanCount[i] == 1) || holders[i] != loanCount[i]) violations++;
+        }
+        metrics = library.getMetrics().json();
+    }
+    removeDataDirectory(dir);
+
+    size_t totalOps = threadCount * opsPerThread;
+    cout << "threads: " << threadCount << ", operations: " << totalOps << "\n";
+    cout << "checkouts: " << checkouts << ", returns: " << returns << ", reservations: " << reservations << "\n";
+    cout << "throughput: " << static_cast<size_t>(totalOps / seconds) << " ops/s\n";
+    cout << "snapshot reads: " << reads << " (" << static_cast<size_t>(reads / seconds) << " reads/s), catalog changes: "
+         << catalogChanges << "\n";
+    cout << "invariant violations: " << violations << "\n";
+    cout << "metrics: " << metrics << "\n";
+    return violations == 0 ? 0 : 1;
+}
 
-    // Serialization method
-    string serialize() const { return memberId + "," + fullName + "," + memberType; }
+// Parameters of a --simulate run
+struct SimulationConfig {
+    size_t students = 2000, faculty = 200, books = 5000;
+    int days = 120;
+    unsigned seed = 1;
 };
 
-// Derived class for students
-class CollegeStudent : public Member {
-public:
-    CollegeStudent(string id, string name) : Member(id, name, "student") {}
-    
-    bool isEligibleToBorrow() const override {
-        return membership.getCheckedOutItems().size() < 3 && membership.getPendingFees() == 0;
-    }
-    
-    int calculateLateFee(int daysLate) const override {
-        return daysLate > 0 ? daysLate * 10 : 0;
+// Run a population of students and faculty through a term of borrowing,
+// returning, reserving, searching and paying on a ManualClock, a simulated
+// day at a time with the nightly fee accrual in between. Demand is three
+// times higher in the first two weeks, the start-of-term rush, and falls
+// on the popular titles first. A run is deterministic for its seed: the
+// final state it prints is the same on every machine, only the ops/s
+// figures measure this one.
+int runSimulation(const SimulationConfig& config) {
+    static const char* subjects[] = {"Calculus", "Physics", "Chemistry", "Biology", "Algorithms", "Databases",
+                                     "Networks", "Economics", "History", "Philosophy", "Statistics", "Compilers",
+                                     "Robotics", "Linguistics", "Geology", "Astronomy"};
+    const size_t SUBJECTS = sizeof(subjects) / sizeof(subjects[0]);
+    const int RUSH_DAYS = 14;
+    const TimePoint TERM_START = TimePoint(chrono::seconds(1754006400));  // 2025-08-01 00:00 UTC
+    size_t population = config.students + config.faculty;
+    if (population == 0 || config.books == 0 || config.days <= 0) {
+        cerr << "Nothing to simulate.\n";
+        return 1;
     }
-};
 
-// Derived class for faculty
-class professor : public Member {
-public:
-    professor(string id, string name) : Member(id, name, "faculty") {}
-    
-    bool isEligibleToBorrow() const override {
-        if (membership.getCheckedOutItems().size() >= 5) return false;
-        
-        auto currentTime = chrono::system_clock::now();
-        for (const auto& item : membership.getCheckedOutItems()) {
-            int daysSinceCheckout = chrono::duration_cast<chrono::hours>
-                                   (currentTime - item.checkoutDate).count() / 24;
-            if (daysSinceCheckout > 90) return false; // 30 days + 60 days late
-        }
-        return true;
+    char dirTemplate[] = "/tmp/library-simulation-XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        cerr << "Cannot create scratch directory.\n";
+        return 1;
     }
-    
-    int calculateLateFee(int daysLate) const override { return 0; }
-};
+    string dir = dirTemplate;
 
-// Derived class for librarians
-class LibraryStaff : public Member {
-public:
-    LibraryStaff(string id, string name) : Member(id, name, "librarian") {}
-    
-    bool isEligibleToBorrow() const override { return false; }
-    int calculateLateFee(int daysLate) const override { return 0; }
-};
-// Library class implementation
-class LibrarySystem {
-    private:
-        vector<Book> catalog;
-        vector<Member*> memberDatabase;
-    
-    public:
-        // Constructor loads data
-        LibrarySystem() { importData(); }
-        
-        // Destructor saves data and cleans up
-        ~LibrarySystem() { 
-            exportData(); 
-            for (Member* m : memberDatabase) delete m; 
-        }
-    
-        // Catalog management methods
-        void addbook(const Book& item) { 
-            catalog.push_back(item); 
-        }
-        
-        void removebook(const string& isbn) {
-            catalog.erase(remove_if(catalog.begin(), catalog.end(), 
-                         [&isbn](const Book& lit) { return lit.getISBN() == isbn; }), 
-                         catalog.end());
-        }
-    
-        // Member management methods
-        void registerMember(Member* member) { 
-            memberDatabase.push_back(member); 
+    // The generator's own arithmetic, so no library distribution makes
+    // runs differ between platforms
+    mt19937 rng(config.seed);
+    auto uniform = [&rng] { return rng() / 4294967296.0; };
+    size_t checkouts = 0, pickups = 0, returns = 0, lateReturns = 0, reservations = 0, refusals = 0;
+    size_t searches = 0, payments = 0, charges = 0, operations = 0, peakOperations = 0;
+    int peakDay = 0;
+    double seconds = 0, paid = 0;
+    ManualClock clock(TERM_START);
+    {
+        LibrarySystem library(false, dir, clock);
+        for (size_t i = 0; i < config.books; i++) {
+            string title = string(subjects[i % SUBJECTS]) + " Volume " + to_string(i / SUBJECTS + 1);
+            library.addbook(Book("SIM" + to_string(i), title, 1990 + i % 35, "Author " + to_string(i % 97), "Campus Press"));
         }
-        
-        void removeMember(const string& memberId) {
-            auto it = find_if(memberDatabase.begin(), memberDatabase.end(),
-                             [&memberId](const Member* m) { return m->getMemberId() == memberId; });
-            if (it != memberDatabase.end()) {
-                delete *it;
-                memberDatabase.erase(it);
-            }
+        vector<Member*> members;
+        for (size_t i = 0; i < population; i++) {
+            bool student = i < config.students;
+            string id = (student ? "SIMSTU" : "SIMFAC") + to_string(i);
+            library.registerMember(id, id, student ? MemberKind::Student : MemberKind::Faculty);
+            members.push_back(library.findMember(id));
         }
-    
-        // Search methods
-        Book* findbook(const string& isbn) {
-            for (auto& item : catalog) {
-                if (item.getISBN() == isbn) return &item;
+
+        // A member's visit: returns, then fees, then picking up holds, a
+        // search now and then and one or two checkouts, reserving a book
+        // that is out half the time
+        auto visit = [&](Member* member) {
+            size_t done = 0;
+            Membership& membership = member->getMembership();
+            vector<BorrowInfo> loans = membership.getCheckedOutItems();
+            for (const BorrowInfo& loan : loans) {
+                // A loan comes back with a chance that grows with its age,
+                // so many come back late
+                int age = daysBetween(loan.checkoutDate, clock.now());
+                if (age < static_cast<int>(rng() % (member->getLoanPeriod() + 15))) continue;
+                if (library.tryReturn(member, loan.isbn) == OpStatus::Ok) {
+                    returns++;
+                    if (age > member->getLoanPeriod()) lateReturns++;
+                }
+                done++;
             }
-            return nullptr;
-        }
-    
-        Member* findMember(const string& memberId) {
-            for (Member* member : memberDatabase) {
-                if (member->getMemberId() == memberId) return member;
+            if (membership.getPendingFees() > 0 && rng() % 2) {
+                paid += membership.getPendingFees();
+                library.payFees(member, membership.getPendingFees());
+                payments++;
+                done++;
             }
-            return nullptr;
-        }
-    
-        // Checkout process
-        void checkoutbook(Member* member, const string& isbn) {
-            Book* item = findbook(isbn);
-            if (!item) { 
-                cout << "Item not found in catalog.\n"; 
-                return; 
+            vector<string> holds = membership.getReservedItems();
+            for (const string& isbn : holds) {
+                if (library.tryCheckout(member, isbn) == OpStatus::Ok) pickups++;
+                done++;
             }
-            
-            if (item->getAvailability() == "borrowed") { 
-                cout << "Item is already checked out.\n"; 
-                return; 
+            if (rng() % 4 == 0) {
+                library.findMatches(subjects[rng() % SUBJECTS]);
+                searches++;
+                done++;
             }
-            
-            if (item->getAvailability() == "reserved" && item->getBookedBy() != member->getMemberId()) {
-                cout << "Item is reserved by another member.\n"; 
-                return;
+            for (unsigned attempt = 1 + rng() % 2; attempt > 0; attempt--) {
+                // Cubing a uniform draw puts most demand on the first titles
+                double u = uniform();
+                string isbn = "SIM" + to_string(static_cast<size_t>(config.books * u * u * u));
+                OpStatus status = library.tryCheckout(member, isbn);
+                done++;
+                if (status == OpStatus::Ok) {
+                    checkouts++;
+                } else if (status == OpStatus::NotEligible) {
+                    refusals++;
+                    break;
+                } else if (rng() % 2) {
+                    if (library.tryReserve(member, isbn) == OpStatus::Ok) reservations++;
+                    done++;
+                }
             }
-            
-            if (!member->isEligibleToBorrow()) { 
-                cout << "You are not eligible to borrow at this time.\n"; 
-                return; 
+            return done;
+        };
+
+        auto start = chrono::steady_clock::now();
+        for (int day = 0; day < config.days; day++) {
+            TimePoint midnight = TERM_START + ONE_DAY * day;
+            clock.set(midnight);
+            charges += library.runFeeAccrual(midnight);
+            size_t today = 1;
+
+            // Visits spread over opening hours, 08:00 to 20:00
+            size_t visits = static_cast<size_t>(population * (day < RUSH_DAYS ? 0.3 : 0.1));
+            for (size_t v = 0; v < visits; v++) {
+                clock.set(midnight + chrono::hours(8) + chrono::seconds(12 * 3600 * v / visits));
+                today += visit(members[rng() % population]);
             }
-            
-            bool wasReservedByMember = (item->getAvailability() == "reserved" && 
-                                      item->getBookedBy() == member->getMemberId());
-            
-            member->getMembership().checkoutItem(isbn);
-            item->setAvailability("borrowed");
-            item->setBookedBy("");  // Clear reservation
-            
-            cout << "Item checked out successfully.\n";
-            
-            if (wasReservedByMember) {
-                int remainingReserved = getReservationCount(member->getMemberId());
-                cout << "Reservation fulfilled. You have " << remainingReserved 
-                     << " remaining reservations.\n";
+            operations += today;
+            if (today > peakOperations) {
+                peakOperations = today;
+                peakDay = day + 1;
             }
         }
-    
-        // Return process
-        void returnbook(Member* member, const string& isbn) {
-            Book* item = findbook(isbn);
-            if (!item) { 
-                cout << "Item not found in catalog.\n"; 
-                return; 
-            }
-            
-            if (item->getAvailability() != "borrowed") { 
-                cout << "Item is not checked out.\n"; 
-                return; 
-            }
-            
-            auto& checkedOut = member->getMembership().getCheckedOutItems();
-            auto it = find_if(checkedOut.begin(), checkedOut.end(), 
-                             [&isbn](const BorrowInfo& info) { return info.isbn == isbn; });
-                             
-            if (it == checkedOut.end()) { 
-                cout << "You have not checked out this item.\n"; 
-                return; 
-            }
-            
-            auto currentTime = chrono::system_clock::now();
-            int daysSinceCheckout = chrono::duration_cast<chrono::hours>
-                                  (currentTime - it->checkoutDate).count() / 24;
-                                  
-            int loanPeriod = (member->getMemberType() == "student") ? 15 : 30;
-            int daysLate = max(0, daysSinceCheckout - loanPeriod);
-            int fee = member->calculateLateFee(daysLate);
-            
-            member->getMembership().returnItem(isbn, fee);
-            item->setAvailability(item->getBookedBy().empty() ? "available" : "reserved");
-            
-            cout << "Item returned successfully.\n";
-            if (fee > 0) cout << "Late fee of " << fee << " rupees applied.\n";
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        // Final state
+        size_t openLoans = 0, blocked = 0;
+        double pending = 0;
+        for (Member* member : members) {
+            openLoans += member->getMembership().getCheckedOutItems().size();
+            pending += member->getMembership().getPendingFees();
+            if (!member->isEligibleToBorrow()) blocked++;
         }
-    
-        // Reservation process
-        void reservebook(Member* member, const string& isbn) {
-            Book* item = findbook(isbn);
-            if (!item) { 
-                cout << "Item not found in catalog.\n"; 
-                return; 
-            }
-            
-            if (item->getAvailability() != "borrowed") { 
-                cout << "Item is not eligible for reservation.\n"; 
-                return; 
-            }
-            
-            if (!item->getBookedBy().empty()) { 
-                cout << "Item is already reserved by someone else.\n"; 
-                return; 
-            }
-            
-            item->setBookedBy(member->getMemberId());
-            cout << "Item reserved successfully.\n";
+        CatalogSnapshot view = library.snapshot();
+        size_t states[3] = {0, 0, 0};
+        for (size_t i = 0; i < config.books; i++) {
+            BookHandle handle = view.find("SIM" + to_string(i));
+            if (handle != NO_HANDLE) states[static_cast<int>(view.state(handle))]++;
         }
-    
-        // Count reservations for a member
-        int getReservationCount(const string& memberId) const {
-            int count = 0;
-            for (const auto& item : catalog) {
-                if (item.getBookedBy() == memberId) count++;
-            }
-            return count;
+        double revenue = 0;
+        for (const auto& month : library.getRevenueByMonth()) revenue += month.second;
+
+        cout << fixed;
+        cout.precision(0);
+        cout << "simulated: " << config.days << " days, " << config.students << " students, " << config.faculty
+             << " faculty, " << config.books << " books, seed " << config.seed << "\n";
+        cout << "operations: " << operations << " (checkouts " << checkouts << ", hold pickups " << pickups
+             << ", returns " << returns << " of which late " << lateReturns << ", reservations " << reservations
+             << ", refused " << refusals << ", searches " << searches << ", payments " << payments
+             << ", nightly late-fee charges " << charges << ")\n";
+        cout << "busiest day: " << peakDay << " with " << peakOperations << " operations\n";
+        cout << "final state: " << openLoans << " open loans, " << library.getOverdueLoans(clock.now()).size()
+             << " overdue; books " << states[0] << " available, " << states[1] << " borrowed, " << states[2]
+             << " reserved; " << blocked << " members blocked\n";
+        cout << "fees: " << revenue << " charged on returns, " << paid << " paid, " << pending << " pending\n";
+        cout << "throughput: " << static_cast<size_t>(operations / seconds) << " ops/s, busiest day in "
+             << seconds * 1000 * peakOperations / operations << " ms\n";
+    }
+    removeDataDirectory(dir);
+    return 0;
+}
+
+// Write a synthetic library in the CSV formats importData reads: a catalog
+// of `books` titles (about 10% borrowed, 2% of those reserved), `members`
+// members (70% students, 25% faculty, 5% staff), some pending fees and
+// four past loans per member over the last two years
+int runGenerator(const string& dir, size_t books, size_t members) {
+    static const char* words[] = {
+        "Advanced", "Applied", "Modern", "Practical", "Introduction", "Principles", "Foundations", "Theory",
+        "Programming", "Data", "Structures", "Algorithms", "Design", "Systems", "Database", "Networks",
+        "Learning", "Machine", "Analysis", "Computing", "Software", "Engineering", "Compilers", "Graphics",
+        "Security", "Distributed", "Parallel", "Operating", "Statistics", "Calculus", "Linear", "Algebra",
+        "Physics", "Chemistry", "Biology", "History", "Economics", "Philosophy", "Logic", "Discrete",
+        "Mathematics", "Probability", "Optimization", "Signals", "Circuits", "Robotics", "Vision", "Language"};
+    static const char* firstNames[] = {"Jane", "John", "Alice", "Bob", "Carol", "David", "Eve", "Frank",
+                                       "Grace", "Heidi", "Ivan", "Judy", "Mallory", "Niaj", "Olivia", "Peggy"};
+    static const char* lastNames[] = {"Doe", "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller",
+                                      "Davis", "Wilson", "Moore", "Taylor", "Anderson", "Thomas", "Lee", "Martin"};
+    const size_t WORDS = sizeof(words) / sizeof(words[0]);
+    mkdir(dir.c_str(), 0755);
+
+    auto openOutput = [&dir](const char* file) { return ::open((dir + "/" + file).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644); };
+    int booksFd = openOutput("book.csv"), membersFd = openOutput("members.csv");
+    int checkoutsFd = openOutput("checkouts.csv"), feesFd = openOutput("fees.csv");
+    int historyFd = openOutput("history.csv");
+    if (booksFd < 0 || membersFd < 0 || checkoutsFd < 0 || feesFd < 0 || historyFd < 0) {
+        cerr << "Cannot write to " << dir << "\n";
+        return 1;
+    }
+
+    auto memberId = [](size_t i) {
+        size_t kind = i % 20;
+        return (kind < 14 ? "STU" : kind < 19 ? "PROF" : "STAFF") + to_string(i);
+    };
+    {
+        BufferedWriter out(membersFd, 1 << 20), fees(feesFd, 1 << 16);
+        for (size_t i = 0; i < members; i++) {
+            size_t kind = i % 20;
+            out << memberId(i) << ",Member " << to_string(i) << ","
+                << (kind < 14 ? "student" : kind < 19 ? "faculty" : "librarian") << "\n";
+            if (kind < 14 && i % 50 == 7) fees << memberId(i) << "," << static_cast<int>(10 * (1 + i % 9)) << "\n";
         }
-    
-        // Search functions
-        void searchCatalog(const string& query) {
-            if (catalog.empty()) { 
-                cout << "Catalog is empty.\n"; 
-                return; 
-            }
-            
-            bool itemFound = false;
-            for (const auto& item : catalog) {
-                if (item.getName().find(query) != string::npos || 
-                    item.getCreator().find(query) != string::npos) {
-                    cout << item.getISBN() << " - " << item.getName() << " by " 
-                         << item.getCreator() << " (" << item.getAvailability() << ")\n";
-                    itemFound = true;
+    }
+
+    // Lend every tenth book to the next borrowing member with room under
+    // the student limit, checked out between 1 and 40 days ago
+    mt19937_64 rng(42);
+    long long now = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    vector<size_t> borrowers;
+    for (size_t i = 0; i < members; i++) {
+        if (i % 20 < 19) borrowers.push_back(i);
+    }
+    vector<unsigned char> loans(members, 0);
+    size_t nextBorrower = 0;
+    {
+        BufferedWriter out(booksFd, 1 << 20), checkouts(checkoutsFd, 1 << 20);
+        for (size_t i = 0; i < books; i++) {
+            string isbn = "BK" + to_string(i);
+            string title = string(words[rng() % WORDS]) + " " + words[rng() % WORDS];
+            if (rng() % 2) title += string(" ") + words[rng() % WORDS];
+            string author = string(firstNames[rng() % 16]) + " " + lastNames[rng() % 16];
+
+            string status = "available", reserver;
+            if (i % 10 == 3 && !borrowers.empty()) {
+                for (size_t tries = 0; tries < borrowers.size(); tries++) {
+                    size_t candidate = borrowers[nextBorrower++ % borrowers.size()];
+                    if (loans[candidate] >= 3) continue;
+                    loans[candidate]++;
+                    status = "borrowed";
+                    checkouts << memberId(candidate) << "," << isbn << ","
+                              << (now - static_cast<long long>(86400 * (1 + rng() % 40))) << "\n";
+                    if (i % 500 == 3) reserver = memberId(borrowers[rng() % borrowers.size()]);
+                    break;
                 }
             }
-            
-            if (!itemFound) cout << "No matching items found.\n";
+            out << isbn << "," << title << "," << author << ",Press " << to_string(i % 300) << ","
+                << static_cast<int>(1950 + rng() % 75) << "," << status << "," << reserver << "\n";
         }
-    
-        // Display catalog
-        void displayCatalog() {
-            if (catalog.empty()) { 
-                cout << "Catalog is empty.\n"; 
-                return; 
-            }
-            
-            for (const auto& item : catalog) {
-                cout << item.getISBN() << " - " << item.getName() 
-                     << " (" << item.getAvailability() << ")\n";
-            }
+    }
+
+    // Returned loans of 1 to 40 days, fined at the member's rate
+    if (books > 0 && !borrowers.empty()) {
+        BufferedWriter out(historyFd, 1 << 20);
+        for (size_t i = 0; i < members * 4; i++) {
+            size_t member = borrowers[rng() % borrowers.size()];
+            const BorrowingPolicy& policy = MEMBER_POLICIES[member % 20 < 14 ? 0 : 1];
+            long long days = 1 + rng() % 40, checkout = now - static_cast<long long>(86400 * (41 + rng() % 690));
+            long long fee = days > policy.loanPeriod ? (days - policy.loanPeriod) * policy.feePerDay : 0;
+            out << "BK" << to_string(rng() % books) << "," << memberId(member) << "," << checkout << ","
+                << checkout + 86400 * days << "," << fee << "\n";
         }
-    
-        // Display member list
-        void displayMembers() {
-            if (memberDatabase.empty()) {
-                cout << "No members registered.\n";
-                return;
+    }
+    for (int fd : {booksFd, membersFd, checkoutsFd, feesFd, historyFd}) ::close(fd);
+    cerr << "Generated " << books << " books and " << members << " members in " << dir << "\n";
+    return 0;
+}
+
+// Time `operation` for `maxIterations` runs or about `maxSeconds`, whichever
+// comes first, and append the result as a JSON object
+template <typename Operation>
+void benchmarkOperation(vector<string>& results, const string& name, size_t maxIterations,
+                        double maxSeconds, Operation operation) {
+    size_t iterations = 0;
+    auto start = chrono::steady_clock::now();
+    while (iterations < maxIterations) {
+        operation(iterations);
+        iterations++;
+        if (iterations % 64 == 0 &&
+            chrono::duration<double>(chrono::steady_clock::now() - start).count() >= maxSeconds) break;
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    ostringstream json;
+    json << "{\"name\":" << jsonQuote(name) << ",\"iterations\":" << iterations
+         << ",\"total_seconds\":" << elapsed << ",\"ns_per_op\":" << (elapsed * 1e9 / iterations)
+         << ",\"ops_per_sec\":" << (iterations / elapsed) << "}";
+    results.push_back(json.str());
+    cerr << name << ": " << (elapsed * 1e9 / iterations) << " ns/op\n";
+}
+
+// Benchmark the core operations against a data directory written by
+// --generate and print the results as one JSON document. Checkouts are
+// returned again, so the data is left equivalent to how it was found.
+int runBenchmarks(const string& dir, const string& outputPath) {
+    if (fileModifiedTime(dir + "/book.csv") == 0 || fileModifiedTime(dir + "/members.csv") == 0) {
+        cerr << "No data in " << dir << ", create it first with --generate " << dir << " <books> <members>\n";
+        return 1;
+    }
+
+    vector<string> results;
+    unique_ptr<LibrarySystem> library;
+    benchmarkOperation(results, "importData", 1, 0, [&](size_t) { library.reset(new LibrarySystem(false, dir)); });
+
+    // Sample keys up front so lookups measure the index, not string building
+    vector<string> isbns, memberIds, queries, prefixes;
+    vector<Member*> borrowers;
+    vector<CatalogFilter> filters;
+    mt19937_64 rng(7);
+    {
+        MappedFile file;
+        file.open(dir + "/book.csv");
+        CsvScanner scanner(file);
+        FieldView f[7];
+        vector<string> all;
+        while (scanner.nextRecord(f, 7)) {
+            if (all.size() < 100000 || rng() % 8 == 0) all.push_back(f[0].str());
+            if (queries.size() < 1000 && rng() % 16 == 0) queries.push_back(f[1].str().substr(0, f[1].size / 2));
+            if (prefixes.size() < 1000 && rng() % 16 == 0) {
+                // Partial ISBNs, titles and authors, as typed at the desk
+                const FieldView& source = f[rng() % 3 == 0 ? 0 : (rng() % 2 ? 1 : 2)];
+                prefixes.push_back(source.str().substr(0, 2 + rng() % 6));
             }
-            
-            for (const auto& member : memberDatabase) {
-                cout << member->getMemberId() << " - " << member->getFullName() 
-                     << " (" << member->getMemberType() << ")\n";
+            if (filters.size() < 1000 && rng() % 16 == 0) {
+                // Available books from a publisher over five years
+                CatalogFilter filter;
+                long long year = 0;
+                parseInt64(f[4], year);
+                filter.publisher = f[3].str();
+                filter.fromYear = static_cast<int32_t>(year - 2);
+                filter.toYear = static_cast<int32_t>(year + 2);
+                filter.states.push_back(Availability::Available);
+                filters.push_back(filter);
             }
         }
-    
-        // Data persistence methods
-        void importData() {
-            // Import catalog
-            ifstream catalogFile("book.csv");
-            if (catalogFile.is_open()) {
-                string line;
-                while (getline(catalogFile, line)) catalog.push_back(Book::deserialize(line));
-                catalogFile.close();
-            } else {
-                // Default catalog data
-                addbook(Book("LIT001", "Advanced Programming", 2022, "Jane Doe", "TechPress"));
-                addbook(Book("LIT002", "Data Structures", 2020, "John Smith", "CodeBooks"));
-                addbook(Book("LIT003", "Algorithm Design", 2021, "Alice Johnson", "CompSci"));
-                addbook(Book("LIT004", "Database Systems", 2019, "Bob Williams", "DataPub"));
-                addbook(Book("LIT005", "Machine Learning", 2023, "Carol Brown", "AIPress"));
-            }
-    
-            // Import members
-            ifstream memberFile("members.csv");
-            if (memberFile.is_open()) {
-                string line;
-                while (getline(memberFile, line)) {
-                    istringstream stream(line);
-                    string id, name, type;
-                    getline(stream, id, ',');
-                    getline(stream, name, ',');
-                    getline(stream, type);
-                    
-                    if (type == "student") registerMember(new CollegeStudent(id, name));
-                    else if (type == "faculty") registerMember(new professor(id, name));
-                    else if (type == "librarian") registerMember(new LibraryStaff(id, name));
-                }
-                memberFile.close();
-            } else {
-                // Default member data
-                registerMember(new CollegeStudent("STU1", "Student One"));
-                registerMember(new CollegeStudent("STU2", "Student Two"));
-                registerMember(new CollegeStudent("STU3", "Student Three"));
-                registerMember(new CollegeStudent("STU4", "Student Four"));
-                registerMember(new CollegeStudent("STU5", "Student Five"));
-                registerMember(new professor("PROF1", "Professor One"));
-                registerMember(new professor("PROF2", "Professor Two"));
-                registerMember(new professor("PROF3", "Professor Three"));
-                registerMember(new LibraryStaff("STAFF1", "Staff One"));
-            }
-    
-            // Import checkout history
-            ifstream checkoutFile("checkouts.csv");
-            if (checkoutFile.is_open()) {
-                string line;
-                while (getline(checkoutFile, line)) {
-                    istringstream stream(line);
-                    string mid, isbn, timeStampStr;
-                    getline(stream, mid, ',');
-                    getline(stream, isbn, ',');
-                    getline(stream, timeStampStr);
-                    
-                    long long timeStamp = stoll(timeStampStr);
-                    auto timePoint = chrono::system_clock::time_point(chrono::seconds(timeStamp));
-                    
-                    Member* m = findMember(mid);
-                    if (m) m->getMembership().addCheckoutRecord({isbn, timePoint});
-                }
-                checkoutFile.close();
-            }
-    
-            // Import fees
-            ifstream feesFile("fees.csv");
-            if (feesFile.is_open()) {
-                string line;
-                while (getline(feesFile, line)) {
-                    istringstream stream(line);
-                    string mid, feeStr;
-                    getline(stream, mid, ',');
-                    getline(stream, feeStr);
-                    
-                    double fee = stod(feeStr);
-                    Member* m = findMember(mid);
-                    if (m) m->getMembership().setPendingFees(fee);
-                }
-                feesFile.close();
-            }
+        for (size_t i = 0; i < 4096 && !all.empty(); i++) isbns.push_back(all[rng() % all.size()]);
+
+        MappedFile members;
+        members.open(dir + "/members.csv");
+        CsvScanner memberScanner(members);
+        FieldView m[3];
+        while (memberScanner.nextRecord(m, 3)) {
+            if (memberIds.size() < 4096) memberIds.push_back(m[0].str());
+            Member* member = library->findMember(m[0].str());
+            if (member && borrowers.size() < 4096 && member->getKind() == MemberKind::Faculty &&
+                member->isEligibleToBorrow()) borrowers.push_back(member);
         }
-    
-        // Export data to files
-        void exportData() {
-            // Export catalog
-            ofstream catalogFile("book.csv");
-            for (const auto& item : catalog) catalogFile << item.serialize() << "\n";
-            catalogFile.close();
-    
-            // Export member data
-            ofstream memberFile("members.csv");
-            for (const auto& member : memberDatabase) memberFile << member->serialize() << "\n";
-            memberFile.close();
-    
-            // Export checkout data
-            ofstream checkoutFile("checkouts.csv");
-            for (const auto& member : memberDatabase) {
-                for (const auto& info : member->getMembership().getCheckedOutItems()) {
-                    long long timeStamp = chrono::duration_cast<chrono::seconds>
-                                        (info.checkoutDate.time_since_epoch()).count();
-                    checkoutFile << member->getMemberId() << "," << info.isbn << "," << timeStamp << "\n";
+    }
+    if (isbns.empty() || memberIds.empty()) {
+        cerr << "Data in " << dir << " is empty.\n";
+        return 1;
+    }
+
+    volatile size_t sink = 0;
+    benchmarkOperation(results, "findbook", 5000000, 1.0, [&](size_t i) {
+        sink += library->findbook(isbns[i % isbns.size()]) != nullptr;
+    });
+    benchmarkOperation(results, "findMember", 5000000, 1.0, [&](size_t i) {
+        sink += library->findMember(memberIds[i % memberIds.size()]) != nullptr;
+    });
+    if (!queries.empty()) {
+        benchmarkOperation(results, "searchCatalog", 100000, 1.0, [&](size_t i) {
+            sink += library->findMatches(queries[i % queries.size()]).size();
+        });
+    }
+    if (!queries.empty()) {
+        // The search queries with one letter of each word replaced
+        vector<string> misspelled;
+        for (const string& query : queries) {
+            string typo = query;
+            for (size_t i = 0; i < typo.size(); i++) {
+                bool wordStart = i == 0 || typo[i - 1] == ' ';
+                if (wordStart && i + 3 < typo.size() && isalpha(static_cast<unsigned char>(typo[i + 2]))) {
+                    typo[i + 2] = typo[i + 2] == 'x' ? 'q' : 'x';
                 }
             }
-            checkoutFile.close();
-    
-            // Export fees data
-            ofstream feesFile("fees.csv");
-            for (const auto& member : memberDatabase) {
-                double fee = member->getMembership().getPendingFees();
-                if (fee > 0) feesFile << member->getMemberId() << "," << fee << "\n";
-            }
-            feesFile.close();
+            misspelled.push_back(typo);
+        }
+        benchmarkOperation(results, "findFuzzyMatches", 100000, 1.0, [&](size_t i) {
+            sink += library->findFuzzyMatches(misspelled[i % misspelled.size()], 20).size();
+        });
+    }
+    if (!prefixes.empty()) {
+        benchmarkOperation(results, "completePrefix", 1000000, 1.0, [&](size_t i) {
+            sink += library->completePrefix(prefixes[i % prefixes.size()], 10).size();
+        });
+    }
+    if (!filters.empty()) {
+        benchmarkOperation(results, "filterCatalog", 100000, 1.0, [&](size_t i) {
+            sink += library->filterCatalog(filters[i % filters.size()], CatalogOrder::Year, LISTING_PAGE_SIZE).size();
+        });
+    }
+    {
+        // Pages of the title listing starting at random books, so the cost
+        // of reaching a deep page shows up
+        int devNull = ::open("/dev/null", O_WRONLY);
+        BufferedWriter out(devNull);
+        vector<ListingCursor> starts;
+        for (const string& isbn : isbns) {
+            Book* item = library->findbook(isbn);
+            if (!item || starts.size() == 256) continue;
+            ListingCursor cursor;
+            cursor.title = item->getName();
+            cursor.year = item->getPublicationYear();
+            cursor.id = isbn;
+            cursor.started = true;
+            starts.push_back(cursor);
         }
+        benchmarkOperation(results, "writeCatalogPage", 1000000, 1.0, [&](size_t i) {
+            ListingCursor cursor = starts[i % starts.size()];
+            sink += library->writeCatalogPage(out, CatalogOrder::Title, cursor, LISTING_PAGE_SIZE);
+        });
+        out.flush();
+        ::close(devNull);
+    }
+    {
+        // The nightly reports; the top titles over the last 90 days
+        TimePoint now = chrono::system_clock::now();
+        benchmarkOperation(results, "getMostBorrowed", 1000, 1.0, [&](size_t) {
+            sink += library->getMostBorrowed(now - chrono::hours(24 * 90), now, 10).size();
+        });
+        benchmarkOperation(results, "getAverageLoanDays", 1000, 1.0, [&](size_t) {
+            sink += library->getAverageLoanDays().size();
+        });
+        benchmarkOperation(results, "getRevenueByMonth", 1000, 1.0, [&](size_t) {
+            sink += library->getRevenueByMonth().size();
+        });
+    }
+    benchmarkOperation(results, "getReservationCount", 100000, 1.0, [&](size_t i) {
+        sink += library->getReservationCount(memberIds[i % memberIds.size()]);
+    });
+
+    // Check out and return available books with eligible faculty members, so
+    // every pair succeeds and leaves the state unchanged
+    vector<string> available;
+    for (const string& isbn : isbns) {
+        Book* item = library->findbook(isbn);
+        if (item && item->getState() == Availability::Available) available.push_back(isbn);
+    }
+    sort(available.begin(), available.end());
+    available.erase(unique(available.begin(), available.end()), available.end());
+    if (!available.empty() && !borrowers.empty()) {
+        size_t pairs = min(available.size(), borrowers.size());
+        benchmarkOperation(results, "checkoutbook+returnbook", 1000000, 1.0, [&](size_t i) {
+            Member* member = borrowers[i % pairs];
+            const string& isbn = available[i % pairs];
+            sink += library->tryCheckout(member, isbn) == OpStatus::Ok;
+            sink += library->tryReturn(member, isbn) == OpStatus::Ok;
+        });
+    }
+
+    benchmarkOperation(results, "exportData", 1, 0, [&](size_t) { library->exportData(); });
+    library.reset();
+
+    ostringstream json;
+    json << "{\"data_dir\":" << jsonQuote(dir) << ",\"timestamp\":"
+         << chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count()
+         << ",\"benchmarks\":[";
+    for (size_t i = 0; i < results.size(); i++) json << (i ? "," : "") << results[i];
+    json << "]}\n";
+
+    int fd = outputPath.empty() ? STDOUT_FILENO : ::open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "Cannot open " << outputPath << "\n";
+        return 1;
+    }
+    {
+        BufferedWriter out(fd);
+        out << json.str();
+    }
+    if (fd != STDOUT_FILENO) ::close(fd);
+    return 0;
+}
+
+// Compare three ways of finding the words within allowedEdits of misspelled
+// queries over a synthetic vocabulary: the scalar DP against every word,
+// the bit-parallel kernel against every word, and the kernel behind the
+// trigram filter. All three must find the same number of matches.
+int runFuzzyBenchmark(size_t words) {
+    mt19937 rng(11);
+    auto randomWord = [&]() {
+        string word;
+        for (size_t i = 0, n = 4 + rng() % 9; i < n; i++) word += static_cast<char>('a' + rng() % 26);
+        return word;
     };
+    vector<string> vocabulary;
+    FuzzyTokenIndex index;
+    while (vocabulary.size() < words) {
+        string word = randomWord();
+        index.add(word);
+        if (index.size() > vocabulary.size()) vocabulary.push_back(word);
+    }
+    vector<string> queries;
+    for (size_t i = 0; i < 200; i++) {
+        string word = vocabulary[rng() % vocabulary.size()];
+        word[rng() % word.size()] = static_cast<char>('a' + rng() % 26);
+        queries.push_back(word);
+    }
+
+    size_t scalarHits = 0, kernelHits = 0, filteredHits = 0;
+    auto start = chrono::steady_clock::now();
+    for (const string& query : queries) {
+        int edits = allowedEdits(query.size());
+        for (const string& word : vocabulary) scalarHits += levenshteinScalar(query, word) <= edits;
+    }
+    double scalarMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (const string& query : queries) {
+        int edits = allowedEdits(query.size());
+        EditDistanceKernel kernel(query);
+        for (const string& word : vocabulary) kernelHits += kernel.distance(word) <= edits;
+    }
+    double kernelMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (const string& query : queries) filteredHits += index.within(query, allowedEdits(query.size())).size();
+    double filteredMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    cout << "vocabulary: " << words << " words, " << queries.size() << " queries\n";
+    cout << "scalar DP scan:       " << scalarMs / queries.size() << " ms/query (" << scalarHits << " hits)\n";
+    cout << "bit-parallel scan:    " << kernelMs / queries.size() << " ms/query (" << kernelHits << " hits)\n";
+    cout << "trigram + bit-parallel: " << filteredMs / queries.size() << " ms/query (" << filteredHits << " hits)\n";
+    cout << "speedup over scalar: " << (kernelMs > 0 ? scalarMs / kernelMs : 0) << "x scan, "
+         << (filteredMs > 0 ? scalarMs / filteredMs : 0) << "x filtered\n";
+    return scalarHits == kernelHits && kernelHits == filteredHits ? 0 : 1;
+}
+
+// Compare the mmap catalog loader with the getline/istringstream path it
+// replaced, on a synthetic catalog written to a scratch file
+int runImportBenchmark(size_t rows) {
+    const string path = "bench_catalog.csv";
+    {
+        ofstream out(path);
+        for (size_t i = 0; i < rows; i++) {
+            out << Book("BK" + to_string(i), "Title " + to_string(i), 1950 + i % 75,
+                        "Author " + to_string(i % 5000), "Publisher " + to_string(i % 300)).serialize() << "\n";
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<Book> streamed;
+    {
+        ifstream in(path);
+        string line;
+        while (getline(in, line)) streamed.push_back(Book::deserialize(line));
+    }
+    auto streamTime = chrono::steady_clock::now() - start;
+
+    start = chrono::steady_clock::now();
+    vector<Book> mapped;
+    {
+        MappedFile file;
+        file.open(path);
+        CsvScanner scanner(file);
+        FieldView f[7];
+        Book item("", "", 0, "", "");
+        while (scanner.nextRecord(f, 7)) {
+            if (bookFromFields(f, item)) mapped.push_back(item);
+        }
+    }
+    auto mappedTime = chrono::steady_clock::now() - start;
+    remove(path.c_str());
+
+    double streamMs = chrono::duration<double, milli>(streamTime).count();
+    double mappedMs = chrono::duration<double, milli>(mappedTime).count();
+    cout << "rows: " << rows << "\n";
+    cout << "istringstream loader: " << streamMs << " ms (" << streamed.size() << " books)\n";
+    cout << "mmap loader:          " << mappedMs << " ms (" << mapped.size() << " books)\n";
+    cout << "speedup: " << (mappedMs > 0 ? streamMs / mappedMs : 0) << "x\n";
+    return streamed.size() == mapped.size() ? 0 : 1;
+}
+
+// Print a listing a page at a time, asking before each further page.
+// writePage writes one page and returns its row count; returns the total.
+template <typename WritePage>
+size_t showPages(WritePage writePage) {
+    string answer;
+    getline(cin, answer);  // rest of the menu line
+    size_t total = 0;
+    while (true) {
+        cout.flush();
+        size_t rows;
+        {
+            BufferedWriter out(STDOUT_FILENO);
+            rows = writePage(out);
+        }
+        total += rows;
+        if (rows < LISTING_PAGE_SIZE) return total;
+
+        cout << "-- Enter for more, q to stop -- ";
+        if (!getline(cin, answer) || answer == "q") return total;
+    }
+}
+
 // Main application function
-int main() {
-    LibrarySystem system;
+int main(int argc, char* argv[]) {
+    vector<string> args(argv + 1, argv + argc);
+    bool binarySnapshot = find(args.begin(), args.end(), "--no-snapshot") == args.end();
+    args.erase(remove(args.begin(), args.end(), "--no-snapshot"), args.end());
+
+    if (!args.empty() && args[0] == "--bench-import") {
+        return runImportBenchmark(args.size() > 1 ? stoul(args[1]) : 1000000);
+    }
+
+    if (!args.empty() && args[0] == "--bench-fuzzy") {
+        return runFuzzyBenchmark(args.size() > 1 ? stoul(args[1]) : 1000000);
+    }
+
+    if (!args.empty() && args[0] == "--generate") {
+        if (args.size() < 4) {
+            cerr << "Usage: main --generate <dir> <books> <members>\n";
+            return 1;
+        }
+        return runGenerator(args[1], stoul(args[2]), stoul(args[3]));
+    }
+
+    if (!args.empty() && args[0] == "--bench") {
+        if (args.size() < 2) {
+            cerr << "Usage: main --bench <dir> [results.json]\n";
+            return 1;
+        }
+        return runBenchmarks(args[1], args.size() > 2 ? args[2] : "");
+    }
+
+    if (!args.empty() && args[0] == "--stress") {
+        unsigned threads = args.size() > 1 ? stoul(args[1]) : max(2u, thread::hardware_concurrency());
+        return runStressTest(threads, args.size() > 2 ? stoul(args[2]) : 100000);
+    }
+
+    if (!args.empty() && args[0] == "--simulate") {
+        SimulationConfig config;
+        if (args.size() > 1) config.students = stoul(args[1]);
+        if (args.size() > 2) config.faculty = stoul(args[2]);
+        if (args.size() > 3) config.days = stoi(args[3]);
+        if (args.size() > 4) config.books = stoul(args[4]);
+        if (args.size() > 5) config.seed = stoul(args[5]);
+        return runSimulation(config);
+    }
+
+    if (!args.empty() && args[0] == "--batch") {
+        if (args.size() < 2) {
+            cerr << "Usage: main --batch <operations.jsonl> [results.jsonl]\n";
+            return 1;
+        }
+        return runBatch(args[1], args.size() > 2 ? args[2] : "", binarySnapshot);
+    }
+
+    if (!args.empty() && args[0] == "--serve") {
+        if (args.size() < 2) {
+            cerr << "Usage: main --serve <socket-path|port>\n";
+            return 1;
+        }
+        return runServer(args[1], binarySnapshot);
+    }
+
+    if (!args.empty() && args[0] == "--loadgen") {
+        if (args.size() < 2) {
+            cerr << "Usage: main --loadgen <socket-path|port> [connections] [requests-per-connection] [pipeline-depth]\n";
+            return 1;
+        }
+        return runLoadGenerator(args[1], args.size() > 2 ? stoul(args[2]) : 1000, args.size() > 3 ? stoul(args[3]) : 200,
+                                args.size() > 4 ? stoul(args[4]) : 16);
+    }
+
+    if (!args.empty() && args[0] == "--ingest") {
+        if (args.size() < 2) {
+            cerr << "Usage: main --ingest <feed.csv> [threads]\n";
+            return 1;
+        }
+        unsigned threads = args.size() > 2 ? stoul(args[2]) : max(1u, thread::hardware_concurrency());
+        return runIngest(args[1], threads, binarySnapshot);
+    }
+
+    if (!args.empty() && args[0] == "--nightly") {
+        return runNightly(binarySnapshot);
+    }
+    if (!args.empty() && args[0] == "--report") {
+        return runReport(vector<string>(args.begin() + 1, args.end()), binarySnapshot);
+    }
+
+    LibrarySystem system(binarySnapshot);
+    system.runFeeAccrual(system.now());
 
     // Main application loop
     while (true) {
@@ -506,7 +6527,8 @@ int main() {
         cin >> input;
         
         if (input == "exit") {
-            cout << "Saving data and exiting..." << endl;
+            system.syncJournal();
+            cout << "All changes are saved. Exiting..." << endl;
             break;
         }
 
@@ -522,7 +6544,7 @@ int main() {
              << " (" << activeMember->getMemberType() << ")" << endl;
 
         // Show summary for students and faculty
-        if (activeMember->getMemberType() == "student" || activeMember->getMemberType() == "faculty") {
+        if (activeMember->canBorrow()) {
             int itemsCheckedOut = activeMember->getMembership().getCheckedOutItems().size();
             int itemsReserved = system.getReservationCount(activeMember->getMemberId());
             cout << "Items checked out: " << itemsCheckedOut << endl;
@@ -530,7 +6552,7 @@ int main() {
         }
 
         // Display appropriate menu based on member type
-        if (activeMember->getMemberType() == "student" || activeMember->getMemberType() == "faculty") {
+        if (activeMember->canBorrow()) {
             // Member menu loop
             while (true) {
                 cout << "\n----- MEMBER MENU -----\n";
@@ -547,7 +6569,7 @@ int main() {
                 int choice;
                 cin >> choice;
                 
-                if (choice == 8) break;
+                if (choice == 8) { system.syncJournal(); break; }
 
                 string isbn, query;
                 switch (choice) {
@@ -563,12 +6585,13 @@ int main() {
                         system.returnbook(activeMember, isbn);
                         break;
                         
-                    case 3: // View checked out items
+                    case 3: { // View checked out items
                         cout << "\nCurrently checked out items:\n";
+                        CatalogSnapshot view = system.snapshot();
                         for (const auto& info : activeMember->getMembership().getCheckedOutItems()) {
-                            Book* item = system.findbook(info.isbn);
-                            if (item) {
-                                cout << info.isbn << " - " << item->getName() << "\n";
+                            BookHandle item = view.find(info.isbn);
+                            if (item != NO_HANDLE) {
+                                cout << info.isbn << " - " << view.book(item).getName() << "\n";
                             } else {
                                 cout << info.isbn << " (Item details not available)\n";
                             }
@@ -577,6 +6600,7 @@ int main() {
                             cout << "No items currently checked out.\n";
                         }
                         break;
+                    }
                         
                     case 4: // View fees
                         cout << "Pending fees: " << activeMember->getMembership().getPendingFees() << " rupees\n";
@@ -585,7 +6609,7 @@ int main() {
                     case 5: {// Pay fees
                         double currentFees = activeMember->getMembership().getPendingFees();
                         cout << "Paying total fees: " << currentFees << " rupees\n";
-                        activeMember->getMembership().clearFees(currentFees);
+                        system.payFees(activeMember, currentFees);
                         cout << "Fees cleared successfully.\n";
                         break;
                     }    
@@ -607,7 +6631,7 @@ int main() {
                 }
             }
         } 
-        else if (activeMember->getMemberType() == "librarian") {
+        else if (activeMember->getKind() == MemberKind::Librarian) {
             // Library staff menu loop
             while (true) {
                 cout << "\n----- STAFF MENU -----\n";
@@ -618,13 +6642,14 @@ int main() {
                 cout << "5. Display full catalog\n";
                 cout << "6. Display all members\n";
                 cout << "7. Search catalog\n";
-                cout << "8. Logout\n";
+                cout << "8. View overdue items\n";
+                cout << "9. Logout\n";
                 cout << "Selection: ";
                 
                 int choice;
                 cin >> choice;
                 
-                if (choice == 8) break;
+                if (choice == 9) { system.syncJournal(); break; }
 
                 string isbn, id, name, type, title, author, publisher, query;
                 int year;
@@ -642,9 +6667,16 @@ int main() {
                         getline(cin, publisher);
                         cout << "Publication Year: ";
                         cin >> year;
-                        
-                        system.addbook(Book(isbn, title, year, author, publisher));
-                        cout << "Item added to catalog successfully.\n";
+
+                        if (!fitsCsvField(isbn) || !fitsCsvField(title) || !fitsCsvField(author) ||
+                            !fitsCsvField(publisher)) {
+                            cout << "ISBN, title, author and publisher cannot contain commas.\n";
+                            break;
+                        }
+                        if (system.addbook(Book(isbn, title, year, author, publisher)))
+                            cout << "Item added to catalog successfully.\n";
+                        else
+                            cout << "An item with this ISBN already exists.\n";
                         break;
                         
                     case 2: // Remove item
@@ -663,12 +6695,17 @@ int main() {
                         cout << "Member Type (student/faculty/librarian): ";
                         cin >> type;
                         
-                        if (type == "student") system.registerMember(new CollegeStudent(id, name));
-                        else if (type == "faculty") system.registerMember(new professor(id, name));
-                        else if (type == "librarian") system.registerMember(new LibraryStaff(id, name));
-                        else cout << "Invalid member type.\n";
-                        
-                        cout << "Member registered successfully.\n";
+                        {
+                            MemberKind kind;
+                            if (!parseMemberKind(type, kind)) { cout << "Invalid member type.\n"; break; }
+                            if (!fitsCsvField(id) || !fitsCsvField(name)) {
+                                cout << "The member ID and name cannot contain commas.\n";
+                                break;
+                            }
+
+                            if (system.registerMember(id, name, kind)) cout << "Member registered successfully.\n";
+                            else cout << "A member with this ID already exists.\n";
+                        }
                         break;
                         
                     case 4: // Remove member
@@ -678,15 +6715,30 @@ int main() {
                         cout << "Member removed successfully.\n";
                         break;
                         
-                    case 5: // Display catalog
+                    case 5: { // Display catalog
+                        cout << "Sort by (isbn/title/year): ";
+                        cin >> type;
+                        CatalogOrder order;
+                        if (!parseCatalogOrder(type, order)) { cout << "Invalid sort order.\n"; break; }
+
                         cout << "\n----- FULL CATALOG -----\n";
-                        system.displayCatalog();
+                        ListingCursor cursor;
+                        size_t rows = showPages([&](BufferedWriter& out) {
+                            return system.writeCatalogPage(out, order, cursor, LISTING_PAGE_SIZE);
+                        });
+                        if (rows == 0) cout << "Catalog is empty.\n";
                         break;
+                    }
                         
-                    case 6: // Display members
+                    case 6: { // Display members
                         cout << "\n----- MEMBER DIRECTORY -----\n";
-                        system.displayMembers();
+                        ListingCursor cursor;
+                        size_t rows = showPages([&](BufferedWriter& out) {
+                            return system.writeMemberPage(out, cursor, LISTING_PAGE_SIZE);
+                        });
+                        if (rows == 0) cout << "No members registered.\n";
                         break;
+                    }
                         
                     case 7: // Search
                         cout << "Enter search term: ";
@@ -695,6 +6747,15 @@ int main() {
                         system.searchCatalog(query);
                         break;
                         
+                    case 8: { // Overdue items
+                        vector<OverdueLoan> overdue = system.getOverdueLoans(system.now());
+                        for (const OverdueLoan& loan : overdue) {
+                            cout << loan.isbn << " - " << loan.memberId << " (" << loan.daysOverdue << " days overdue)\n";
+                        }
+                        if (overdue.empty()) cout << "No overdue items.\n";
+                        break;
+                    }
+                        
                     default:
                         cout << "Invalid selection. Please try again.\n";
                 }
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Ingests feeds that start with the shipped books.csv header and with a
+# lower-case header, and checks that only the malformed row is rejected.
+# Usage: tests/ingest_header.sh [path/to/main]
+set -e
+repo=$(cd "$(dirname "$0")/.." && pwd)
+main=$(cd "$(dirname "${1:-$repo/main}")" && pwd)/$(basename "${1:-$repo/main}")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cp "$repo/books.csv" "$repo/users.csv" "$repo/borrowings.csv" "$repo/fines.csv" "$dir/"
+cd "$dir"
+
+check() {
+    "$main" --ingest "$1" < /dev/null > /dev/null 2>&1
+    if grep -qi '^1,' "$1.rejects.csv"; then echo "FAIL: header of $1 rejected"; cat "$1.rejects.csv"; exit 1; fi
+    grep -q '^3,missing_fields,' "$1.rejects.csv" || { echo "FAIL: bad row of $1 not rejected"; cat "$1.rejects.csv"; exit 1; }
+}
+
+{ head -n 1 books.csv; echo "FEED1,Feed Book,A,P,2021"; echo "bad,row"; } > shipped.csv
+check shipped.csv
+{ echo "isbn,title,author,publisher,year"; echo "FEED2,Feed Book,A,P,2021"; echo "bad,row"; } > lower.csv
+check lower.csv
+echo "ingest_header: ok"